@@ -0,0 +1,69 @@
+#include "blit.h"
+#include "utils.h"
+
+/*
+ * Everything walks the destination a scanline at a time so that stores are
+ * sequential. Fills go out two pixels per store and copies use memcpy(),
+ * which moves words when source and destination line up.
+ */
+
+static void fill_span(u32 *dst, u32 rgba_color, u64 n) {
+    u64  pair;
+    u64 *dst64;
+
+    if (n > 0 && !IS_ALIGNED(dst, 8)) {
+        *dst  = rgba_color;
+        dst  += 1;
+        n    -= 1;
+    }
+
+    pair  = ((u64)rgba_color << 32) | rgba_color;
+    dst64 = (u64*)dst;
+
+    for (; n >= 8; n -= 8) {
+        dst64[0] = pair;
+        dst64[1] = pair;
+        dst64[2] = pair;
+        dst64[3] = pair;
+        dst64   += 4;
+    }
+
+    for (; n >= 2; n -= 2) {
+        *dst64  = pair;
+        dst64  += 1;
+    }
+
+    if (n > 0) {
+        *(u32*)dst64 = rgba_color;
+    }
+}
+
+void blit_fill(u32 *dst, u32 dst_stride, u32 w, u32 h, u32 rgba_color) {
+    u32 y;
+
+    /* Full-width rectangles are one contiguous span. */
+    if (w == dst_stride) {
+        fill_span(dst, rgba_color, (u64)w * h);
+        return;
+    }
+
+    for (y = 0; y < h; y += 1) {
+        fill_span(dst, rgba_color, w);
+        dst += dst_stride;
+    }
+}
+
+void blit_copy(u32 *dst, u32 dst_stride, const u32 *src, u32 src_stride, u32 w, u32 h) {
+    u32 y;
+
+    if (w == dst_stride && w == src_stride) {
+        memcpy(dst, src, 4ULL * w * h);
+        return;
+    }
+
+    for (y = 0; y < h; y += 1) {
+        memcpy(dst, src, 4ULL * w);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
@@ -1,25 +1,395 @@
 #include "blk.h"
 #include "driver.h"
 #include "kprint.h"
+#include "kmalloc.h"
+#include "array.h"
+#include "lock.h"
+#include "sbi.h"
+#include "utils.h"
+#include "machine.h"
+
+/*
+ * Requests don't go straight to the driver. They sit in a per-device queue,
+ * sorted by offset, until someone waits on one of them and either the oldest
+ * pending request has been there for the device's deadline or the queue is
+ * full. Whoever dispatches takes the whole queue, coalesces runs of adjacent
+ * (or, for reads, overlapping) requests into single driver calls and
+ * completes everyone in the run.
+ */
+
+#define BLK_QUEUE_BATCH (32)
+#define BLK_MERGE_MAX   (KB(128))
+
+enum {
+    BLK_RQ_PENDING,
+    BLK_RQ_DISPATCHED,
+    BLK_RQ_DONE,
+};
+
+struct Blk_Request {
+    struct Blk_Request *next;
+    u32                 write;
+    u64                 offset;
+    u64                 len;
+    u8                 *buff;
+    u64                 queued_at;
+    s64                 status;
+    volatile u32        state;
+};
+
+typedef struct {
+    u32           adid;
+    Driver_State *dev;
+    Spinlock      lock;
+    Blk_Request  *pending;
+    u32           n_pending;
+    u64           oldest;
+    u64           deadline; /* Cycles a request may wait for merge partners. 0 = dispatch on first wait. */
+} Blk_Queue;
+
+static array_t  queues;
+static Spinlock queues_lock;
+
+static Blk_Queue *get_queue(u32 adid) {
+    Blk_Queue    **it;
+    Blk_Queue     *queue;
+    Driver_State  *state;
+
+    spin_lock(&queues_lock);
+
+    if (queues.elem_size == 0) {
+        queues = array_make(Blk_Queue*);
+    }
+
+    array_traverse(queues, it) {
+        if ((*it)->adid == adid) {
+            queue = *it;
+            goto out;
+        }
+    }
+
+    queue = NULL;
+
+    if ((state = driver_for_adid(adid)) == NULL
+    ||  state->driver->type != DRV_BLOCK) {
+        goto out;
+    }
+
+    queue = kmalloc(sizeof(*queue));
+    memset(queue, 0, sizeof(*queue));
+    queue->adid = adid;
+    queue->dev  = state;
+
+    array_push(queues, queue);
+
+out:;
+    spin_unlock(&queues_lock);
+
+    return queue;
+}
+
+static s64 overlaps(Blk_Request *a, Blk_Request *b) {
+    return a->offset < b->offset + b->len
+        && b->offset < a->offset + a->len;
+}
+
+static s64 do_io(Blk_Queue *queue, u32 write, u64 offset, u8 *buff, u64 len) {
+    if (write) {
+        return queue->dev->driver->block.write(queue->dev, offset, buff, len);
+    }
+
+    return queue->dev->driver->block.read(queue->dev, offset, buff, len);
+}
+
+static void complete(Blk_Request *rq, s64 status) {
+    rq->status = status;
+    MEMORY_FENCE();
+    rq->state  = BLK_RQ_DONE;
+}
+
+static void dispatch(Blk_Queue *queue, Blk_Request *list) {
+    Blk_Request *first;
+    Blk_Request *last;
+    Blk_Request *rq;
+    Blk_Request *next;
+    u64          start;
+    u64          end;
+    u8          *buff;
+    s64          status;
+
+    while (list != NULL) {
+        first = last = list;
+        start = first->offset;
+        end   = first->offset + first->len;
+
+        while ((next = last->next) != NULL
+        &&     next->write == first->write
+        &&     (first->write ? next->offset == end : next->offset <= end)
+        &&     MAX(end, next->offset + next->len) - start <= BLK_MERGE_MAX) {
+
+            last = next;
+            end  = MAX(end, next->offset + next->len);
+        }
+
+        list       = last->next;
+        last->next = NULL;
+
+        if (first == last) {
+            complete(first, do_io(queue, first->write, first->offset, first->buff, first->len));
+            continue;
+        }
+
+        buff = kmalloc(end - start);
+
+        if (first->write) {
+            for (rq = first; rq != NULL; rq = rq->next) {
+                memcpy(buff + (rq->offset - start), rq->buff, rq->len);
+            }
+        }
+
+        status = do_io(queue, first->write, start, buff, end - start);
+
+        for (rq = first; rq != NULL; rq = next) {
+            next = rq->next;
+
+            if (!rq->write && status == 0) {
+                memcpy(rq->buff, buff + (rq->offset - start), rq->len);
+            }
+
+            /* rq may be freed by its waiter as soon as this lands. */
+            complete(rq, status);
+        }
+
+        kfree(buff);
+    }
+}
+
+/* Must be called with the queue lock held. Returns the list to dispatch. */
+static Blk_Request *take_pending(Blk_Queue *queue) {
+    Blk_Request *list;
+    Blk_Request *rq;
+
+    list = queue->pending;
+
+    for (rq = list; rq != NULL; rq = rq->next) {
+        rq->state = BLK_RQ_DISPATCHED;
+    }
+
+    queue->pending   = NULL;
+    queue->n_pending = 0;
+
+    return list;
+}
+
+static Blk_Request *enqueue(u32 adid, u32 write, u64 offset, u8 *buff, u64 len) {
+    Blk_Queue    *queue;
+    Blk_Request  *rq;
+    Blk_Request **link;
+    Blk_Request  *barrier;
+
+    if ((queue = get_queue(adid)) == NULL) {
+        kprint("no viable block driver or device found\n");
+        return NULL;
+    }
+
+    rq = kmalloc(sizeof(*rq));
+    memset(rq, 0, sizeof(*rq));
+
+    rq->write     = write;
+    rq->offset    = offset;
+    rq->len       = len;
+    rq->buff      = buff;
+    rq->queued_at = sbicall(SBI_CLOCK);
+    rq->state     = BLK_RQ_PENDING;
+
+    spin_lock(&queue->lock);
+
+    /*
+     * Sorting would let a read overtake a write to the same bytes (or two
+     * writes swap), so anything that conflicts with the new request has to
+     * reach the device first. It is dispatched before the new request is
+     * published; otherwise another hart could take and dispatch the new one
+     * ahead of it. More conflicts may have queued up meanwhile, so check again.
+     */
+    for (;;) {
+        barrier = NULL;
+
+        for (link = &queue->pending; *link != NULL; link = &(*link)->next) {
+            if ((write || (*link)->write) && overlaps(*link, rq)) {
+                barrier = take_pending(queue);
+                break;
+            }
+        }
+
+        if (barrier == NULL) { break; }
+
+        spin_unlock(&queue->lock);
+        dispatch(queue, barrier);
+        spin_lock(&queue->lock);
+    }
+
+    for (link = &queue->pending; *link != NULL && (*link)->offset <= offset; link = &(*link)->next);
+
+    rq->next = *link;
+    *link    = rq;
+
+    if (queue->n_pending == 0) {
+        queue->oldest = rq->queued_at;
+    }
+    queue->n_pending += 1;
+
+    spin_unlock(&queue->lock);
+
+    return rq;
+}
+
+Blk_Request *blk_read_async(u32 adid, u64 offset, u8 *buff, u64 len) {
+    return enqueue(adid, 0, offset, buff, len);
+}
+
+Blk_Request *blk_write_async(u32 adid, u64 offset, const u8 *buff, u64 len) {
+    return enqueue(adid, 1, offset, (u8*)buff, len);
+}
+
+s64 blk_wait(u32 adid, Blk_Request *rq) {
+    Blk_Queue   *queue;
+    Blk_Request *list;
+    s64          status;
+
+    if (rq == NULL) { return -1; }
+
+    queue = get_queue(adid);
+
+    while (rq->state != BLK_RQ_DONE) {
+        list = NULL;
+
+        if (rq->state == BLK_RQ_PENDING) {
+            spin_lock(&queue->lock);
+
+            if (rq->state == BLK_RQ_PENDING
+            &&  (queue->n_pending >= BLK_QUEUE_BATCH
+              || sbicall(SBI_CLOCK) - queue->oldest >= queue->deadline)) {
+
+                list = take_pending(queue);
+            }
+
+            spin_unlock(&queue->lock);
+        }
+
+        if (list != NULL) {
+            dispatch(queue, list);
+        }
+    }
+
+    status = rq->status;
+
+    kfree(rq);
+
+    return status;
+}
+
+void blk_unplug(u32 adid) {
+    Blk_Queue   *queue;
+    Blk_Request *list;
+
+    if ((queue = get_queue(adid)) == NULL) { return; }
+
+    spin_lock(&queue->lock);
+    list = take_pending(queue);
+    spin_unlock(&queue->lock);
+
+    dispatch(queue, list);
+}
 
 s64 blk_read(u32 adid, u64 offset, u8 *buff, u64 len) {
+    return blk_wait(adid, blk_read_async(adid, offset, buff, len));
+}
+
+s64 blk_write(u32 adid, u64 offset, const u8 *buff, u64 len) {
+    return blk_wait(adid, blk_write_async(adid, offset, buff, len));
+}
+
+/*
+ * The following bypass the request queue, so anything still pending for the
+ * device is pushed out first to keep them ordered after earlier writes.
+ */
+s64 blk_flush(u32 adid) {
+    Blk_Queue *queue;
+
+    if ((queue = get_queue(adid)) == NULL) { return -1; }
+
+    blk_unplug(adid);
+
+    if (queue->dev->driver->block.flush == NULL) { return 0; }
+
+    return queue->dev->driver->block.flush(queue->dev);
+}
+
+s64 blk_discard(u32 adid, u64 offset, u64 len) {
+    Blk_Queue *queue;
+
+    if ((queue = get_queue(adid)) == NULL) { return -1; }
+
+    blk_unplug(adid);
+
+    if (queue->dev->driver->block.discard == NULL) { return 0; }
+
+    return queue->dev->driver->block.discard(queue->dev, offset, len);
+}
+
+/* Unlike discard, this is not advisory: the driver has to zero the range however it can. */
+s64 blk_write_zeroes(u32 adid, u64 offset, u64 len) {
+    Blk_Queue *queue;
+
+    if ((queue = get_queue(adid)) == NULL) { return -1; }
+
+    blk_unplug(adid);
+
+    if (queue->dev->driver->block.write_zeroes == NULL) { return -1; }
+
+    return queue->dev->driver->block.write_zeroes(queue->dev, offset, len);
+}
+
+s64 blk_get_deadline(u32 adid, u64 *cycles) {
+    Blk_Queue *queue;
+
+    if ((queue = get_queue(adid)) == NULL) { return -1; }
+
+    *cycles = queue->deadline;
+
+    return 0;
+}
+
+s64 blk_set_deadline(u32 adid, u64 cycles) {
+    Blk_Queue *queue;
+
+    if ((queue = get_queue(adid)) == NULL) { return -1; }
+
+    queue->deadline = cycles;
+
+    return 0;
+}
+
+s64 blk_get_poll(u32 adid, u64 *cycles) {
     Driver_State *state;
 
-    if ((state = driver_for_adid(adid)) == NULL) {
-        kprint("no viable block driver or device found\n");
+    if ((state = driver_for_adid(adid)) == NULL
+    ||  state->driver->block.get_poll == NULL) {
         return -1;
     }
 
-    return state->driver->block.read(state, offset, buff, len);
+    *cycles = state->driver->block.get_poll(state);
+
+    return 0;
 }
 
-s64 blk_write(u32 adid, u64 offset, const u8 *buff, u64 len) {
+s64 blk_set_poll(u32 adid, u64 cycles) {
     Driver_State *state;
 
-    if ((state = driver_for_adid(adid)) == NULL) {
-        kprint("no viable block driver or device found\n");
+    if ((state = driver_for_adid(adid)) == NULL
+    ||  state->driver->block.set_poll == NULL) {
         return -1;
     }
 
-    return state->driver->block.write(state, offset, buff, len);
+    return state->driver->block.set_poll(state, cycles);
 }
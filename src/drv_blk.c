@@ -5,20 +5,31 @@
 #include "kprint.h"
 #include "machine.h"
 #include "utils.h"
+#include "sbi.h"
 
 static DRV_INIT_FN(init, drv_state);
 static DRV_IRQ_FN(irq, drv_state);
 static DRV_BLK_READ_FN(read, drv_state, offset, buffer, len);
 static DRV_BLK_WRITE_FN(write, drv_state, offset, buffer, len);
+static DRV_BLK_GET_POLL_FN(get_poll, drv_state);
+static DRV_BLK_SET_POLL_FN(set_poll, drv_state, cycles);
+static DRV_BLK_FLUSH_FN(flush, drv_state);
+static DRV_BLK_DISCARD_FN(discard, drv_state, offset, len);
+static DRV_BLK_WRITE_ZEROES_FN(write_zeroes, drv_state, offset, len);
 
 Driver DRIVER_BLK = {
-    .name        = "virtio-block",
-    .device_id   = PCI_TO_DEVICE_ID(0x1AF4, 0x1042),
-    .type        = DRV_BLOCK,
-    .init        = init,
-    .irq         = irq,
-    .block.read  = read,
-    .block.write = write,
+    .name               = "virtio-block",
+    .device_id          = PCI_TO_DEVICE_ID(0x1AF4, 0x1042),
+    .type               = DRV_BLOCK,
+    .init               = init,
+    .irq                = irq,
+    .block.read         = read,
+    .block.write        = write,
+    .block.get_poll     = get_poll,
+    .block.set_poll     = set_poll,
+    .block.flush        = flush,
+    .block.discard      = discard,
+    .block.write_zeroes = write_zeroes,
 };
 
 typedef struct {
@@ -42,7 +53,8 @@ typedef struct {
    } topology;
 
    u8  writeback;
-   u8  unused0[3];
+   u8  unused0;
+   u16 num_queues;         /* only valid with VIRTIO_BLK_F_MQ */
    u32 max_discard_sectors;
    u32 max_discard_seg;
    u32 discard_sector_alignment;
@@ -52,6 +64,11 @@ typedef struct {
    u8  unused1[3];
 } VirtIO_Block_Config;
 
+#define VIRTIO_BLK_F_FLUSH        (9)
+#define VIRTIO_BLK_F_MQ           (12)
+#define VIRTIO_BLK_F_DISCARD      (13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (14)
+
 #define VIRTIO_BLK_T_IN           (0)
 #define VIRTIO_BLK_T_OUT          (1)
 #define VIRTIO_BLK_T_FLUSH        (4)
@@ -62,20 +79,18 @@ typedef struct {
 #define VIRTIO_BLK_S_IOERR        (1)
 #define VIRTIO_BLK_S_UNSUPP       (2)
 
-enum {
-    BLK_NONE_IN_FLIGHT,
-    BLK_READ,
-    BLK_WRITE,
-};
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1 << 0)
+
+/* Zeroes written through the fallback path go out in chunks of this size. */
+#define ZERO_CHUNK (KB(64))
 
 typedef struct {
     VirtIO_Device_Info            vio_info;
+    VirtIO_Queue                 *queues;   /* One per hart, or shared round-robin if the device has fewer. */
+    u32                           n_queues;
     volatile VirtIO_Block_Config *vio_blk_config;
-    u32                           in_flight;
-    u8                           *buff_virt;
-    u64                           len;
-    u8                           *dst_buff_virt;
-    u64                           blk_offset;
+    u64                           poll_cycles; /* How long to spin on the used ring before waiting for the IRQ. 0 = off. */
+    u64                           features;
 } Block_State;
 
 typedef struct {
@@ -92,9 +107,50 @@ typedef struct {
     u8 status;
 } Request_Status;
 
+/* Payload of DISCARD and WRITE_ZEROES requests. */
+typedef struct {
+    u64 sector;
+    u32 num_sectors;
+    u32 flags;
+} Request_Segment;
+
+typedef struct {
+    Request_Header  header;
+    Request_Status  status;
+    volatile u32    done;
+} Block_Request;
+
+static VirtIO_Queue *hart_queue(Block_State *state) {
+    return &state->queues[sbicall(SBI_HART_ID) % state->n_queues];
+}
+
+static void reap(VirtIO_Queue *queue) {
+    Block_Request *rq;
+
+    while ((rq = virtio_queue_pop_used(queue, NULL)) != NULL) {
+        rq->done = 1;
+    }
+}
+
+static void wait_for_request(Block_State *state, VirtIO_Queue *queue, Block_Request *rq) {
+    u64 start;
+
+    if (state->poll_cycles) {
+        start = sbicall(SBI_CLOCK);
+
+        while (!rq->done) {
+            reap(queue);
+            if (sbicall(SBI_CLOCK) - start >= state->poll_cycles) { break; }
+        }
+    }
+
+    while (!rq->done) { WAIT_FOR_INTERRUPT(); }
+}
+
 static DRV_INIT_FN(init, drv_state) {
     Block_State *state;
-    u32        queue_size;
+    u64          features;
+    u32          q;
 
     state = kmalloc(sizeof(Block_State));
     memset(state, 0, sizeof(*state));
@@ -107,28 +163,35 @@ static DRV_INIT_FN(init, drv_state) {
     state->vio_info.pci_common->device_status  = VIRTIO_DEV_STATUS_RESET;
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_ACKNOWLEDGE;
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_DRIVER;
-    state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_FEATURES_OK;
-
-    state->vio_info.pci_common->queue_select = 0;
 
-    queue_size = state->vio_info.pci_common->queue_size;
+    features = virtio_negotiate_features(&state->vio_info,
+                                           VIRTIO_FEATURE(VIRTIO_F_RING_PACKED)
+                                         | VIRTIO_FEATURE(VIRTIO_BLK_F_MQ)
+                                         | VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH)
+                                         | VIRTIO_FEATURE(VIRTIO_BLK_F_DISCARD)
+                                         | VIRTIO_FEATURE(VIRTIO_BLK_F_WRITE_ZEROES));
+    state->features = features;
 
-    state->vio_info.descriptor_table         = kmalloc(16 * queue_size);
-    memset(state->vio_info.descriptor_table, 0, 16 * queue_size);
-    state->vio_info.pci_common->queue_desc   = virt_to_phys(kernel_pt, (u64)state->vio_info.descriptor_table);
-    state->vio_info.desc_idx                 = 0;
+    state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_FEATURES_OK;
 
-    state->vio_info.driver_ring              = kmalloc(6 + 2 * queue_size);
-    memset(state->vio_info.driver_ring, 0, 6 + 2 * queue_size);
-    state->vio_info.pci_common->queue_driver = virt_to_phys(kernel_pt, (u64)state->vio_info.driver_ring);
+    if (!(state->vio_info.pci_common->device_status & VIRTIO_DEV_STATUS_FEATURES_OK)) {
+        kprint("virtio-blk: device rejected features\n");
+        return -1;
+    }
 
-    state->vio_info.device_ring              = kmalloc(6 + 8 * queue_size);
-    memset(state->vio_info.device_ring, 0, 6 + 8 * queue_size);
-    state->vio_info.pci_common->queue_device = virt_to_phys(kernel_pt, (u64)state->vio_info.device_ring);
-    state->vio_info.used_idx                 = 0;
+    state->n_queues = 1;
+    if (features & VIRTIO_FEATURE(VIRTIO_BLK_F_MQ)) {
+        state->n_queues = MIN(MAX(state->vio_blk_config->num_queues, 1), MAX_HARTS);
+    }
 
+    state->queues = kmalloc(state->n_queues * sizeof(VirtIO_Queue));
 
-    state->vio_info.pci_common->queue_enable = 1;
+    for (q = 0; q < state->n_queues; q += 1) {
+        if (virtio_queue_init(&state->vio_info, &state->queues[q], q) != 0) {
+            kprint("virtio-blk: could not set up request queue %u\n", q);
+            return -1;
+        }
+    }
 
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_DRIVER_OK;
 
@@ -136,254 +199,315 @@ static DRV_INIT_FN(init, drv_state) {
 }
 
 static DRV_IRQ_FN(irq, drv_state) {
-    Block_State          *state;
-    VirtQ_Used_Ring_Elem  used;
-    VirtIO_Descriptor    *desc;
-    Request_Status       *status;
+    Block_State *state;
+    u32          q;
 
     state = drv_state->data;
 
+    /*
+     * We only have the shared INTx line through the PLIC (no MSI-X), so one
+     * interrupt can stand for completions on any of the queues.
+     */
     if (state->vio_info.pci_isr->queue_interrupt) {
-        while (state->vio_info.used_idx != state->vio_info.device_ring->idx) {
-            used = state->vio_info.device_ring->ring[state->vio_info.used_idx];
-
-            /* Header */
-            desc = state->vio_info.descriptor_table + used.id;
-            /* Data */
-            desc = state->vio_info.descriptor_table + desc->next;
-            /* Status */
-            desc = state->vio_info.descriptor_table + desc->next;
-
-            status = (void*)desc->addr;
-
-            switch (status->status) {
-                case VIRTIO_BLK_S_OK:
-                    if (state->in_flight == BLK_READ) {
-                        memcpy(state->dst_buff_virt, state->buff_virt + state->blk_offset, state->len);
-                    } else if (state->in_flight == BLK_WRITE) {
-                    }
-                    break;
-                case VIRTIO_BLK_S_IOERR:
-                    kprint("virtio-blk: IOERR\n");
-                    break;
-                case VIRTIO_BLK_S_UNSUPP:
-                    kprint("virtio-blk: UNSUPP\n");
-                    break;
-                case 123:
-                    kprint("virtio-blk: status unchanged\n");
-                    break;
-                default:
-                    kprint("virtio-blk: unknown status\n");
-                    break;
-            }
-
-            state->vio_info.used_idx += 1;
+        for (q = 0; q < state->n_queues; q += 1) {
+            reap(&state->queues[q]);
         }
 
-        state->in_flight = 0;
-
         return 0;
     }
 
     return -1;
 }
 
+static s64 do_request(Block_State *state, u32 type, u64 sector, u8 *data, u64 data_len) {
+    VirtIO_Queue  *queue;
+    Block_Request *rq;
+    VirtIO_Buffer  bufs[3];
+    u32            n_bufs;
+    s64            status;
+
+    rq = kmalloc(sizeof(*rq));
+    memset(rq, 0, sizeof(*rq));
+
+    rq->header.type   = type;
+    rq->header.sector = sector;
+    rq->status.status = 123;
+
+    n_bufs = 0;
+
+    /* Header */
+    bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)&rq->header);
+    bufs[n_bufs].len   = sizeof(rq->header);
+    bufs[n_bufs].flags = 0;
+    n_bufs += 1;
+
+    /* Data */
+    if (data_len > 0) {
+        bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)data);
+        bufs[n_bufs].len   = data_len;
+        bufs[n_bufs].flags = type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+        n_bufs += 1;
+    }
+
+    /* Status */
+    bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)&rq->status);
+    bufs[n_bufs].len   = sizeof(rq->status);
+    bufs[n_bufs].flags = VIRTQ_DESC_F_WRITE;
+    n_bufs += 1;
+
+    queue = hart_queue(state);
+
+    while (virtio_queue_submit(queue, bufs, n_bufs, rq) < 0) { WAIT_FOR_INTERRUPT(); }
+
+    virtio_queue_notify(queue);
+
+    wait_for_request(state, queue, rq);
+
+    status = -1;
+
+    switch (rq->status.status) {
+        case VIRTIO_BLK_S_OK:
+            status = 0;
+            break;
+        case VIRTIO_BLK_S_IOERR:
+            kprint("virtio-blk: IOERR\n");
+            break;
+        case VIRTIO_BLK_S_UNSUPP:
+            kprint("virtio-blk: UNSUPP\n");
+            break;
+        case 123:
+            kprint("virtio-blk: status unchanged\n");
+            break;
+        default:
+            kprint("virtio-blk: unknown status\n");
+            break;
+    }
+
+    kfree(rq);
+
+    return status;
+}
+
 static DRV_BLK_READ_FN(read, drv_state, offset, buffer, len) {
-    Block_State    *state;
-    u64             blk_size;
-    u64             bytes_needed;
-    u32             idx;
-    u32             mod;
-    Request_Status *rq_status;
-    u32             idx_status;
-    Request_Data   *rq_data;
-    u32             idx_data;
-    Request_Header *rq_header;
-    u64             notif_base;
-    u64             notif_offset;
-    u64             notif_mult;
-    volatile u32   *notify_addr;
+    Block_State *state;
+    u64          blk_size;
+    u64          first_sector;
+    u64          n_sectors;
+    u8          *bounce;
+    s64          status;
 
     state = drv_state->data;
 
+    if (len == 0) { return 0; }
 
     blk_size     = state->vio_blk_config->blk_size;
-    bytes_needed = blk_size * (1 + (len / blk_size));
+    first_sector = offset / blk_size;
+    n_sectors    = ((offset + len + blk_size - 1) / blk_size) - first_sector;
 
+    /* Whole sectors can go straight into the caller's buffer. */
+    if (offset % blk_size == 0 && len % blk_size == 0) {
+        return do_request(state, VIRTIO_BLK_T_IN, first_sector, buffer, len);
+    }
 
-    state->buff_virt     = kmalloc(bytes_needed);
-    state->len           = len;
-    state->dst_buff_virt = buffer;
-    state->blk_offset    = offset % blk_size;
+    bounce = kmalloc(n_sectors * blk_size);
 
+    status = do_request(state, VIRTIO_BLK_T_IN, first_sector, bounce, n_sectors * blk_size);
 
-    idx = state->vio_info.desc_idx;
-    mod = state->vio_info.pci_common->queue_size;
+    if (status == 0) {
+        memcpy(buffer, bounce + (offset % blk_size), len);
+    }
 
+    kfree(bounce);
 
-    /* Status */
-    rq_status = kmalloc(sizeof(*rq_status));
-    rq_status->status = 123;
+    return status;
+}
 
-    idx_status                                  = idx;
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_status);
-    state->vio_info.descriptor_table[idx].len   = sizeof(*rq_status);
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_WRITE;
-    state->vio_info.descriptor_table[idx].next  = 0;
+static DRV_BLK_WRITE_FN(write, drv_state, offset, buffer, len) {
+    Block_State *state;
+    u64          blk_size;
+    u64          first_sector;
+    u64          n_sectors;
+    u8          *bounce;
+    s64          status;
 
-    idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    state = drv_state->data;
 
-    /* Data */
-    rq_data = (void*)state->buff_virt;
+    if (len == 0) { return 0; }
 
-    idx_data                                    = idx;
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_data);
-    state->vio_info.descriptor_table[idx].len   = bytes_needed;
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-    state->vio_info.descriptor_table[idx].next  = idx_status;
+    blk_size     = state->vio_blk_config->blk_size;
+    first_sector = offset / blk_size;
+    n_sectors    = ((offset + len + blk_size - 1) / blk_size) - first_sector;
 
-    idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    if (offset % blk_size == 0 && len % blk_size == 0) {
+        return do_request(state, VIRTIO_BLK_T_OUT, first_sector, (u8*)buffer, len);
+    }
 
-    /* Header */
-    rq_header = kmalloc(sizeof(*rq_header));
-    memset(rq_status, 0, sizeof(*rq_header));
+    bounce = kmalloc(n_sectors * blk_size);
 
-    rq_header->type   = VIRTIO_BLK_T_IN;
-    rq_header->sector = offset / blk_size;
+    /* Preserve the parts of the first and last sectors that we don't cover. */
+    if (offset % blk_size != 0) {
+        do_request(state, VIRTIO_BLK_T_IN, first_sector, bounce, blk_size);
+    }
+    if ((offset + len) % blk_size != 0
+    &&  (n_sectors > 1 || offset % blk_size == 0)) {
+        do_request(state, VIRTIO_BLK_T_IN, first_sector + n_sectors - 1, bounce + (n_sectors - 1) * blk_size, blk_size);
+    }
 
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_header);
-    state->vio_info.descriptor_table[idx].len   = sizeof(*rq_header);
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_NEXT;
-    state->vio_info.descriptor_table[idx].next  = idx_data;
+    memcpy(bounce + (offset % blk_size), buffer, len);
 
+    status = do_request(state, VIRTIO_BLK_T_OUT, first_sector, bounce, n_sectors * blk_size);
 
-    state->vio_info.driver_ring->ring[state->vio_info.driver_ring->idx % mod]  = idx;
-    state->vio_info.driver_ring->idx                                          += 1;
+    kfree(bounce);
 
-    state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    return status;
+}
 
+static DRV_BLK_GET_POLL_FN(get_poll, drv_state) {
+    Block_State *state;
 
-    notif_base   = (u64)state->vio_info.pci_notify_bar;
-    notif_offset = state->vio_info.pci_notify->cap.offset;
-    notif_mult   = state->vio_info.pci_notify->notify_off_multiplier;
-    notify_addr  = (void*)(notif_base + notif_offset + state->vio_info.pci_common->queue_notify_off * notif_mult);
+    state = drv_state->data;
 
-    state->in_flight = BLK_READ;
+    return state->poll_cycles;
+}
 
-    *notify_addr = 0;
+static DRV_BLK_SET_POLL_FN(set_poll, drv_state, cycles) {
+    Block_State *state;
 
-    while (state->in_flight) { WAIT_FOR_INTERRUPT(); }
+    state = drv_state->data;
 
-    kfree(rq_header);
-    kfree(rq_data);
-    kfree(rq_status);
+    state->poll_cycles = cycles;
 
     return 0;
 }
 
-static DRV_BLK_WRITE_FN(write, drv_state, offset, buffer, len) {
-    Block_State    *state;
-    u64             blk_size;
-    u64             bytes_needed;
-    u8             *first_block;
-    u8             *last_block;
-    u32             idx;
-    u32             mod;
-    Request_Status *rq_status;
-    u32             idx_status;
-    Request_Data   *rq_data;
-    u32             idx_data;
-    Request_Header *rq_header;
-    u64             notif_base;
-    u64             notif_offset;
-    u64             notif_mult;
-    volatile u32   *notify_addr;
+static DRV_BLK_FLUSH_FN(flush, drv_state) {
+    Block_State *state;
 
     state = drv_state->data;
 
+    /* Without VIRTIO_BLK_F_FLUSH the device is write-through. */
+    if (!(state->features & VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH))) { return 0; }
 
-    blk_size     = state->vio_blk_config->blk_size;
-    bytes_needed = blk_size * (1 + (len / blk_size));
+    return do_request(state, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
 
-    first_block = kmalloc(blk_size);
-    read(drv_state, blk_size * (offset / blk_size), first_block, blk_size);
+/*
+ * Issue DISCARD or WRITE_ZEROES for whole sectors [sector, sector + n_sectors),
+ * split so that no request exceeds the device's limit.
+ */
+static s64 do_segments(Block_State *state, u32 type, u64 sector, u64 n_sectors, u32 max_sectors, u32 flags) {
+    Request_Segment *seg;
+    s64              status;
 
-    last_block  = kmalloc(blk_size);
-    read(drv_state, blk_size * ((offset + len) / blk_size), last_block, blk_size);
+    if (max_sectors == 0) { max_sectors = 0xFFFFFFFF; }
 
-    state->buff_virt     = kmalloc(bytes_needed);
-    state->len           = len;
-    state->dst_buff_virt = NULL;
-    state->blk_offset    = offset % blk_size;
+    seg    = kmalloc(sizeof(*seg));
+    status = 0;
 
-    memcpy(state->buff_virt,                           first_block, blk_size);
-    memcpy(state->buff_virt + bytes_needed - blk_size, last_block,  blk_size);
-    memcpy(state->buff_virt + state->blk_offset,       buffer,      len);
+    while (n_sectors > 0 && status == 0) {
+        seg->sector      = sector;
+        seg->num_sectors = MIN(n_sectors, max_sectors);
+        seg->flags       = flags;
 
-    kfree(last_block);
-    kfree(first_block);
+        status = do_request(state, type, 0, (u8*)seg, sizeof(*seg));
 
+        sector    += seg->num_sectors;
+        n_sectors -= seg->num_sectors;
+    }
 
-    idx = state->vio_info.desc_idx;
-    mod = state->vio_info.pci_common->queue_size;
+    kfree(seg);
 
+    return status;
+}
 
-    /* Status */
-    rq_status         = kmalloc(sizeof(*rq_status));
-    rq_status->status = 123;
+static DRV_BLK_DISCARD_FN(discard, drv_state, offset, len) {
+    Block_State *state;
+    u64          blk_size;
+    u64          first_sector;
+    u64          end_sector;
 
-    idx_status                                  = idx;
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_status);
-    state->vio_info.descriptor_table[idx].len   = sizeof(*rq_status);
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_WRITE;
-    state->vio_info.descriptor_table[idx].next  = 0;
+    state = drv_state->data;
 
-    idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    /* Discard is only a hint, so there's nothing to do if it isn't offered. */
+    if (!(state->features & VIRTIO_FEATURE(VIRTIO_BLK_F_DISCARD))) { return 0; }
 
-    /* Data */
-    rq_data = (void*)state->buff_virt;
+    blk_size     = state->vio_blk_config->blk_size;
+    first_sector = (offset + blk_size - 1) / blk_size;
+    end_sector   = (offset + len) / blk_size;
+
+    /* Partial sectors at the edges are left alone. */
+    if (end_sector <= first_sector) { return 0; }
+
+    return do_segments(state,
+                       VIRTIO_BLK_T_DISCARD,
+                       first_sector,
+                       end_sector - first_sector,
+                       state->vio_blk_config->max_discard_sectors,
+                       0);
+}
 
-    idx_data                                    = idx;
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_data);
-    state->vio_info.descriptor_table[idx].len   = bytes_needed;
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_NEXT;
-    state->vio_info.descriptor_table[idx].next  = idx_status;
+static s64 write_zero_bytes(Driver_State *drv_state, u64 offset, u64 len) {
+    u8  *zeroes;
+    u64  n;
+    s64  status;
 
-    idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    zeroes = kmalloc(MIN(len, ZERO_CHUNK));
+    memset(zeroes, 0, MIN(len, ZERO_CHUNK));
 
-    /* Header */
-    rq_header = kmalloc(sizeof(*rq_header));
-    memset(rq_status, 0, sizeof(*rq_header));
+    status = 0;
 
-    rq_header->type   = VIRTIO_BLK_T_OUT;
-    rq_header->sector = offset / blk_size;
+    while (len > 0 && status == 0) {
+        n       = MIN(len, ZERO_CHUNK);
+        status  = write(drv_state, offset, zeroes, n);
+        offset += n;
+        len    -= n;
+    }
 
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq_header);
-    state->vio_info.descriptor_table[idx].len   = sizeof(*rq_header);
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_NEXT;
-    state->vio_info.descriptor_table[idx].next  = idx_data;
+    kfree(zeroes);
 
+    return status;
+}
 
-    state->vio_info.driver_ring->ring[state->vio_info.driver_ring->idx % mod]  = idx;
-    state->vio_info.driver_ring->idx                                          += 1;
+static DRV_BLK_WRITE_ZEROES_FN(write_zeroes, drv_state, offset, len) {
+    Block_State *state;
+    u64          blk_size;
+    u64          first_sector;
+    u64          end_sector;
+    s64          status;
 
-    state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    state = drv_state->data;
 
+    if (len == 0) { return 0; }
 
-    notif_base   = (u64)state->vio_info.pci_notify_bar;
-    notif_offset = state->vio_info.pci_notify->cap.offset;
-    notif_mult   = state->vio_info.pci_notify->notify_off_multiplier;
-    notify_addr  = (void*)(notif_base + notif_offset + state->vio_info.pci_common->queue_notify_off * notif_mult);
+    if (!(state->features & VIRTIO_FEATURE(VIRTIO_BLK_F_WRITE_ZEROES))) {
+        return write_zero_bytes(drv_state, offset, len);
+    }
 
-    state->in_flight = BLK_WRITE;
+    blk_size     = state->vio_blk_config->blk_size;
+    first_sector = (offset + blk_size - 1) / blk_size;
+    end_sector   = (offset + len) / blk_size;
 
-    *notify_addr = 0;
+    if (end_sector <= first_sector) {
+        return write_zero_bytes(drv_state, offset, len);
+    }
 
-    while (state->in_flight) { WAIT_FOR_INTERRUPT(); }
+    /* The device only zeroes whole sectors; the ragged edges are written by hand. */
+    status = 0;
 
-    kfree(rq_header);
-    kfree(rq_data);
-    kfree(rq_status);
+    if (offset < first_sector * blk_size) {
+        status = write_zero_bytes(drv_state, offset, first_sector * blk_size - offset);
+    }
+    if (status == 0 && offset + len > end_sector * blk_size) {
+        status = write_zero_bytes(drv_state, end_sector * blk_size, offset + len - end_sector * blk_size);
+    }
+    if (status == 0) {
+        status = do_segments(state,
+                             VIRTIO_BLK_T_WRITE_ZEROES,
+                             first_sector,
+                             end_sector - first_sector,
+                             state->vio_blk_config->max_write_zeroes_sectors,
+                             VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+    }
 
-    return 0;
+    return status;
 }
@@ -6,6 +6,9 @@
 #include "machine.h"
 #include "utils.h"
 #include "input.h"
+#include "lock.h"
+#include "blit.h"
+#include "syscall.h"
 
 
 static DRV_INIT_FN(init, drv_state);
@@ -13,9 +16,11 @@ static DRV_IRQ_FN(irq, drv_state);
 static DRV_GPU_RESET_DISPLAY_FN(reset_display, drv_state);
 static DRV_GPU_CLEAR_FN(clear, drv_state, rgba_color);
 static DRV_GPU_GET_RECT_FN(get_rect, drv_state, x, y, w, h);
-static DRV_GPU_PIXELS_FN(pixels, drv_state, x, y, w, h, pixels);
+static DRV_GPU_PIXELS_FN(pixels, drv_state, x, y, w, h, stride, pixels);
 static DRV_GPU_RECT_FN(rect, drv_state, x, y, w, h, rgba_color);
 static DRV_GPU_COMMIT_FN(commit, drv_state);
+static DRV_GPU_SET_CURSOR_FN(set_cursor, drv_state, pixels, hot_x, hot_y);
+static DRV_GPU_MOVE_CURSOR_FN(move_cursor, drv_state, x, y);
 
 Driver DRIVER_GPU = {
     .name              = "virtio-gpu",
@@ -29,6 +34,8 @@ Driver DRIVER_GPU = {
     .gpu.pixels        = pixels,
     .gpu.rect          = rect,
     .gpu.commit        = commit,
+    .gpu.set_cursor    = set_cursor,
+    .gpu.move_cursor   = move_cursor,
 };
 
 
@@ -174,14 +181,68 @@ typedef struct {
     u32            __padding;
 } Resource_Flush_Request;
 
+/* Cursor queue commands. MOVE_CURSOR only looks at pos. */
+typedef struct {
+    u32 scanout_id;
+    u32 x;
+    u32 y;
+    u32 __padding;
+} Cursor_Pos;
+
+typedef struct {
+    Control_Header header;
+    Cursor_Pos     pos;
+    u32            resource_id;
+    u32            hot_x;
+    u32            hot_y;
+    u32            __padding;
+} Update_Cursor_Request;
+
+/* Resources 1 and 2 are the framebuffers. */
+#define CURSOR_RESOURCE_ID (3)
+
+/*
+ * Regions of fb written since the last commit. Overlapping rectangles are
+ * merged as they come in; once the list is full everything collapses into its
+ * bounding box, so a commit never costs more than a full-screen transfer.
+ */
+#define GPU_MAX_DAMAGE (16)
+
+typedef struct GPU_Cmd {
+    struct GPU_Cmd *next;
+    u32             cmd;
+    Control_Header *rq;
+    u64             rq_size;
+    Control_Header *rs;
+    u64             rs_size;
+    GPU_Mem_Entry  *mem_entry;
+    s32             buffer;    /* fbs[] index the device reads from for this command, or -1. */
+    volatile u32    done;      /* Set from irq(). */
+} GPU_Cmd;
+
 typedef struct {
     VirtIO_Device_Info          vio_info;
+    VirtIO_Queue                queue;
     volatile VirtIO_GPU_Config *vio_gpu_config;
-    u32                         cmd_pending;
     Display                     display;
-    u32                        *fb;
+    u32                        *fbs[2];
+    u32                        *fb;      /* fbs[back]: what drawing goes into */
+    u32                         back;    /* Resource back + 1 is the one being drawn. */
+    u32                         pending[2];
     u64                         fb_size; /* in pixels */
+    u64                         fb_cap;  /* Pixels each of fbs[] has room for. */
     u32                         display_updated;
+    Rect                        damage[GPU_MAX_DAMAGE];
+    u32                         n_damage;
+    Rect                        prev_damage[GPU_MAX_DAMAGE]; /* What the last commit changed. */
+    u32                         n_prev_damage;
+    Spinlock                    cmd_lock;
+    GPU_Cmd                    *in_flight; /* Asynchronous commands, freed by reap_cmds() once done. */
+    VirtIO_Queue                cursor_queue;
+    u32                        *cursor;    /* GPU_CURSOR_SIZE^2 backing for CURSOR_RESOURCE_ID, NULL until first set. */
+    u32                         cursor_x;
+    u32                         cursor_y;
+    Spinlock                    cursor_lock;
 } GPU_State;
 
 
@@ -189,8 +250,8 @@ typedef struct {
 #define RECT_AS_ARGS(_rect) (_rect.x), (_rect.y), (_rect.w), (_rect.h)
 
 
-void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
-    va_list                          args;
+static GPU_Cmd *build_cmd(u32 cmd, va_list *args) {
+    GPU_Cmd                         *c;
     Control_Header                  *rq;
     u64                              rq_size;
     Control_Header                  *rs;
@@ -203,19 +264,10 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
     Set_Scanout_Request             *rq_set_scanout;
     Transfer_To_Host_2D_Request     *rq_transfer;
     Resource_Flush_Request          *rq_flush;
-    u32                              idx;
-    u32                              mod;
-    u64                              rs_idx;
-    u64                              mem_entry_idx;
-    u64                              base;
-    u64                              offset;
-    u64                              mult;
-    volatile u32                    *notify_addr;
-
 
-    va_start(args, cmd);
-
-    rq = NULL;
+    rq        = NULL;
+    rs        = NULL;
+    mem_entry = NULL;
 
     switch (cmd) {
         case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
@@ -237,10 +289,10 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_create_2D              = (void*)rq;
-            rq_create_2D->resource_id = va_arg(args, u32);
-            rq_create_2D->format      = va_arg(args, u32);
-            rq_create_2D->width       = va_arg(args, u32);
-            rq_create_2D->height      = va_arg(args, u32);
+            rq_create_2D->resource_id = va_arg(*args, u32);
+            rq_create_2D->format      = va_arg(*args, u32);
+            rq_create_2D->width       = va_arg(*args, u32);
+            rq_create_2D->height      = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -255,7 +307,7 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_unref              = (void*)rq;
-            rq_unref->resource_id = va_arg(args, u32);
+            rq_unref->resource_id = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -270,13 +322,13 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_attach              = (void*)rq;
-            rq_attach->resource_id = va_arg(args, u32);
-            rq_attach->n_entries   = va_arg(args, u32);
+            rq_attach->resource_id = va_arg(*args, u32);
+            rq_attach->n_entries   = va_arg(*args, u32);
 
             mem_entry = kmalloc(sizeof(GPU_Mem_Entry));
             memset(mem_entry, 0, sizeof(GPU_Mem_Entry));
-            mem_entry->addr   = va_arg(args, u64);
-            mem_entry->length = va_arg(args, u32);
+            mem_entry->addr   = va_arg(*args, u64);
+            mem_entry->length = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -291,7 +343,7 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_detach              = (void*)rq;
-            rq_detach->resource_id = va_arg(args, u32);
+            rq_detach->resource_id = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -306,12 +358,12 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_set_scanout              = (void*)rq;
-            rq_set_scanout->rect.x      = va_arg(args, u32);
-            rq_set_scanout->rect.y      = va_arg(args, u32);
-            rq_set_scanout->rect.w      = va_arg(args, u32);
-            rq_set_scanout->rect.h      = va_arg(args, u32);
-            rq_set_scanout->scanout_id  = va_arg(args, u32);
-            rq_set_scanout->resource_id = va_arg(args, u32);
+            rq_set_scanout->rect.x      = va_arg(*args, u32);
+            rq_set_scanout->rect.y      = va_arg(*args, u32);
+            rq_set_scanout->rect.w      = va_arg(*args, u32);
+            rq_set_scanout->rect.h      = va_arg(*args, u32);
+            rq_set_scanout->scanout_id  = va_arg(*args, u32);
+            rq_set_scanout->resource_id = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -326,12 +378,12 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_transfer              = (void*)rq;
-            rq_transfer->rect.x      = va_arg(args, u32);
-            rq_transfer->rect.y      = va_arg(args, u32);
-            rq_transfer->rect.w      = va_arg(args, u32);
-            rq_transfer->rect.h      = va_arg(args, u32);
-            rq_transfer->offset      = va_arg(args, u64);
-            rq_transfer->resource_id = va_arg(args, u32);
+            rq_transfer->rect.x      = va_arg(*args, u32);
+            rq_transfer->rect.y      = va_arg(*args, u32);
+            rq_transfer->rect.w      = va_arg(*args, u32);
+            rq_transfer->rect.h      = va_arg(*args, u32);
+            rq_transfer->offset      = va_arg(*args, u64);
+            rq_transfer->resource_id = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -346,11 +398,11 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             rq->control_type = cmd;
 
             rq_flush              = (void*)rq;
-            rq_flush->rect.x      = va_arg(args, u32);
-            rq_flush->rect.y      = va_arg(args, u32);
-            rq_flush->rect.w      = va_arg(args, u32);
-            rq_flush->rect.h      = va_arg(args, u32);
-            rq_flush->resource_id = va_arg(args, u32);
+            rq_flush->rect.x      = va_arg(*args, u32);
+            rq_flush->rect.y      = va_arg(*args, u32);
+            rq_flush->rect.w      = va_arg(*args, u32);
+            rq_flush->rect.h      = va_arg(*args, u32);
+            rq_flush->resource_id = va_arg(*args, u32);
 
             rs_size = sizeof(Control_Header);
             rs      = kmalloc(rs_size);
@@ -359,158 +411,539 @@ void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
             break;
     }
 
-    va_end(args);
-
     if (rq == NULL) {
         kprint("%runhandled GPU command %u!%_\n", cmd);
         return NULL;
     }
 
-    idx = state->vio_info.desc_idx;
-    mod = state->vio_info.pci_common->queue_size;
+    c = kmalloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
 
-    /* Response */
-    rs_idx                                      = idx;
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rs);
-    state->vio_info.descriptor_table[idx].len   = rs_size;
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_WRITE;
-    state->vio_info.descriptor_table[idx].next  = 0;
+    c->cmd       = cmd;
+    c->rq        = rq;
+    c->rq_size   = rq_size;
+    c->rs        = rs;
+    c->rs_size   = rs_size;
+    c->mem_entry = mem_entry;
+
+    return c;
+}
 
-    idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+static void check_response(GPU_Cmd *c) {
+    /* Cursor queue commands get no response. */
+    if (c->rs != NULL && c->rs->control_type >= VIRTIO_GPU_RESP_ERR_UNSPEC) {
+        kprint("%rrequest failed for GPU cmd %u!%_\n", c->cmd);
+    }
+}
 
+static void free_cmd(GPU_Cmd *c) {
+    kfree(c->rq);
+    if (c->mem_entry != NULL) {
+        kfree(c->mem_entry);
+    }
+    if (c->rs != NULL) {
+        kfree(c->rs);
+    }
+    kfree(c);
+}
 
-    /* Mem entry */
-    if (cmd == VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING) {
-        mem_entry_idx                               = idx;
-        state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)mem_entry);
-        state->vio_info.descriptor_table[idx].len   = sizeof(GPU_Mem_Entry);
-        state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_NEXT;
-        state->vio_info.descriptor_table[idx].next  = rs_idx;
+/* Frees the asynchronous commands that the device has finished with. */
+static void reap_cmds(GPU_State *state) {
+    GPU_Cmd **link;
+    GPU_Cmd  *c;
+    GPU_Cmd  *done;
 
-        idx = state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    done = NULL;
+
+    spin_lock(&state->cmd_lock);
+
+    for (link = &state->in_flight; *link != NULL;) {
+        c = *link;
+
+        if (c->done) {
+            if (c->buffer >= 0) {
+                state->pending[c->buffer] -= 1;
+            }
+
+            *link   = c->next;
+            c->next = done;
+            done    = c;
+        } else {
+            link = &c->next;
+        }
     }
 
+    spin_unlock(&state->cmd_lock);
+
+    while ((c = done) != NULL) {
+        done = c->next;
+        check_response(c);
+        free_cmd(c);
+    }
+}
+
+/*
+ * Puts a command on the control queue without telling the device; kick()
+ * does that for everything queued so far. Only blocks if the queue is full,
+ * in which case whatever is already queued is kicked to make room.
+ */
+static GPU_Cmd *vqueue_cmd(GPU_State *state, u32 async, s32 buffer, u32 cmd, va_list *args) {
+    GPU_Cmd       *c;
+    VirtIO_Buffer  bufs[3];
+    u32            n_bufs;
+
+    reap_cmds(state);
+
+    if ((c = build_cmd(cmd, args)) == NULL) { return NULL; }
+
+    c->buffer = buffer;
+
+    n_bufs = 0;
 
     /* Request */
-    state->vio_info.descriptor_table[idx].addr  = virt_to_phys(kernel_pt, (u64)rq);
-    state->vio_info.descriptor_table[idx].len   = rq_size;
-    state->vio_info.descriptor_table[idx].flags = VIRTQ_DESC_F_NEXT;
-    state->vio_info.descriptor_table[idx].next  = (cmd == VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING)
-                                                    ? mem_entry_idx
-                                                    : rs_idx;
+    bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)c->rq);
+    bufs[n_bufs].len   = c->rq_size;
+    bufs[n_bufs].flags = 0;
+    n_bufs += 1;
 
-    state->vio_info.driver_ring->ring[state->vio_info.driver_ring->idx % mod]  = idx;
-    state->vio_info.driver_ring->idx                                          += 1;
+    /* Mem entry */
+    if (c->mem_entry != NULL) {
+        bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)c->mem_entry);
+        bufs[n_bufs].len   = sizeof(GPU_Mem_Entry);
+        bufs[n_bufs].flags = 0;
+        n_bufs += 1;
+    }
 
-    state->vio_info.desc_idx = (state->vio_info.desc_idx + 1) % mod;
+    /* Response */
+    bufs[n_bufs].addr  = virt_to_phys(kernel_pt, (u64)c->rs);
+    bufs[n_bufs].len   = c->rs_size;
+    bufs[n_bufs].flags = VIRTQ_DESC_F_WRITE;
+    n_bufs += 1;
+
+    if (async) {
+        spin_lock(&state->cmd_lock);
+        c->next          = state->in_flight;
+        state->in_flight = c;
+        if (buffer >= 0) {
+            state->pending[buffer] += 1;
+        }
+        spin_unlock(&state->cmd_lock);
+    }
 
+    while (virtio_queue_submit(&state->queue, bufs, n_bufs, (void*)&c->done) < 0) {
+        virtio_queue_notify(&state->queue);
+        WAIT_FOR_INTERRUPT();
+        reap_cmds(state);
+    }
 
-    base   = (u64)state->vio_info.pci_notify_bar;
-    offset = state->vio_info.pci_notify->cap.offset;
-    mult   = state->vio_info.pci_notify->notify_off_multiplier;
+    return c;
+}
 
-    notify_addr = (void*)(base + offset + state->vio_info.pci_common->queue_notify_off * mult);
+static void queue_cmd(GPU_State *state, s32 buffer, u32 cmd, ...) {
+    va_list args;
 
-    state->cmd_pending = 1;
+    va_start(args, cmd);
+    vqueue_cmd(state, 1, buffer, cmd, &args);
+    va_end(args);
+}
 
-    *notify_addr = 0;
+static void kick(GPU_State *state) {
+    virtio_queue_notify(&state->queue);
+}
 
-    while (state->cmd_pending) { WAIT_FOR_INTERRUPT(); }
+/*
+ * The cursor queue is separate from the control queue and its commands are a
+ * single descriptor with no response, so they skip vqueue_cmd(). They are
+ * tracked on the same in-flight list and go out immediately.
+ */
+static void queue_cursor_cmd(GPU_State *state, u32 cmd, u32 x, u32 y, u32 hot_x, u32 hot_y) {
+    GPU_Cmd               *c;
+    Update_Cursor_Request *rq;
+    VirtIO_Buffer          buf;
+
+    reap_cmds(state);
+
+    rq = kmalloc(sizeof(*rq));
+    memset(rq, 0, sizeof(*rq));
+
+    rq->header.control_type = cmd;
+    rq->pos.scanout_id      = 0;
+    rq->pos.x               = x;
+    rq->pos.y               = y;
+    rq->resource_id         = CURSOR_RESOURCE_ID;
+    rq->hot_x               = hot_x;
+    rq->hot_y               = hot_y;
+
+    c = kmalloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+
+    c->cmd     = cmd;
+    c->rq      = (void*)rq;
+    c->rq_size = sizeof(*rq);
+    c->buffer  = -1;
+
+    spin_lock(&state->cmd_lock);
+    c->next          = state->in_flight;
+    state->in_flight = c;
+    spin_unlock(&state->cmd_lock);
+
+    buf.addr  = virt_to_phys(kernel_pt, (u64)rq);
+    buf.len   = sizeof(*rq);
+    buf.flags = 0;
+
+    while (virtio_queue_submit(&state->cursor_queue, &buf, 1, (void*)&c->done) < 0) {
+        virtio_queue_notify(&state->cursor_queue);
+        WAIT_FOR_INTERRUPT();
+        reap_cmds(state);
+    }
 
-    kfree(rq);
-    if (cmd == VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING) {
-        kfree(mem_entry);
+    virtio_queue_notify(&state->cursor_queue);
+}
+
+/* Waits until every asynchronous command has completed. */
+static void drain_cmds(GPU_State *state) {
+    kick(state);
+
+    for (;;) {
+        reap_cmds(state);
+
+        if (state->in_flight == NULL) { break; }
+
+        WAIT_FOR_INTERRUPT();
     }
+}
+
+static void wait_buffer(GPU_State *state, u32 buffer) {
+    kick(state);
 
-    if (rs->control_type >= VIRTIO_GPU_RESP_ERR_UNSPEC) {
-        kprint("%rrequest failed for GPU cmd %u!%_\n", cmd);
+    for (;;) {
+        reap_cmds(state);
+
+        if (state->pending[buffer] == 0) { break; }
+
+        WAIT_FOR_INTERRUPT();
     }
+}
 
-    return (void*)rs;
+/* Synchronous: anything queued before it goes out with it, and the caller owns the response. */
+void * gpu_cmd(GPU_State *state, u32 cmd, ...) {
+    va_list  args;
+    GPU_Cmd *c;
+    void    *rs;
+
+    va_start(args, cmd);
+    c = vqueue_cmd(state, 0, -1, cmd, &args);
+    va_end(args);
+
+    if (c == NULL) { return NULL; }
+
+    kick(state);
+
+    while (!c->done) { WAIT_FOR_INTERRUPT(); }
+
+    check_response(c);
+
+    rs    = c->rs;
+    c->rs = NULL;
+    free_cmd(c);
+
+    return rs;
 }
 
 
 
-static void do_flush(GPU_State *state) {
-    Control_Header *response;
+static s64 rects_overlap(Rect *a, Rect *b) {
+    return a->x < b->x + b->w && b->x < a->x + a->w
+        && a->y < b->y + b->h && b->y < a->y + a->h;
+}
 
-    response = gpu_cmd(state, VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D,
-                       RECT_AS_ARGS(state->display.rect),
-                       0, /* offset */
-                       1 /* resource_id */);
-    kfree(response);
+static void rect_union(Rect *a, Rect *b) {
+    u32 x2;
+    u32 y2;
 
-    response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_FLUSH,
-                       RECT_AS_ARGS(state->display.rect),
-                       1 /* resource_id */);
-    kfree(response);
+    x2   = MAX(a->x + a->w, b->x + b->w);
+    y2   = MAX(a->y + a->h, b->y + b->h);
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->w = x2 - a->x;
+    a->h = y2 - a->y;
 }
 
-static void do_reset_display(GPU_State *state) {
-    Display_Info_Reponse *display_info;
-    Control_Header       *response;
-    Input_Event           event;
+static void add_damage(GPU_State *state, u32 x, u32 y, u32 w, u32 h) {
+    Rect new;
+    u32  i;
 
+    if (x >= state->display.rect.w || y >= state->display.rect.h) { return; }
 
-    display_info = gpu_cmd(state, VIRTIO_GPU_CMD_GET_DISPLAY_INFO);
-    memcpy(&state->display, &display_info->displays[0], sizeof(state->display));
+    new.x = x;
+    new.y = y;
+    new.w = MIN(w, state->display.rect.w - x);
+    new.h = MIN(h, state->display.rect.h - y);
 
-    kfree(display_info);
+    if (new.w == 0 || new.h == 0) { return; }
 
-    if (state->fb != NULL) {
-        response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING,
-                           1 /* resource_id */);
-        kfree(response);
+    /* Absorbing one rectangle can make the result overlap another, so start over after each merge. */
+    for (i = 0; i < state->n_damage;) {
+        if (rects_overlap(&state->damage[i], &new)) {
+            rect_union(&new, &state->damage[i]);
+            state->damage[i] = state->damage[state->n_damage - 1];
+            state->n_damage -= 1;
+            i = 0;
+        } else {
+            i += 1;
+        }
+    }
 
-        response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_UNREF,
-                           1 /* resource_id */);
-        kfree(response);
+    if (state->n_damage == GPU_MAX_DAMAGE) {
+        for (i = 1; i < state->n_damage; i += 1) {
+            rect_union(&state->damage[0], &state->damage[i]);
+        }
+        rect_union(&state->damage[0], &new);
+        state->n_damage = 1;
+        return;
+    }
 
-        kfree(state->fb);
+    state->damage[state->n_damage] = new;
+    state->n_damage += 1;
+}
+
+static void damage_all(GPU_State *state) {
+    state->damage[0].x = 0;
+    state->damage[0].y = 0;
+    state->damage[0].w = state->display.rect.w;
+    state->damage[0].h = state->display.rect.h;
+    state->n_damage    = 1;
+}
+
+/*
+ * Page flip. The back buffer's resource is brought up to date and made the
+ * scanout, then drawing moves to the other buffer while that goes out.
+ *
+ * The resource being presented was last presented two commits ago, so it is
+ * missing both this commit's damage and the previous one's. The new back
+ * buffer only misses this commit's damage, which is copied over once the
+ * device is done with the buffer. That copy usually costs nothing to wait
+ * for, since the buffer's own commands went out a whole frame earlier.
+ */
+static void present(GPU_State *state) {
+    Rect  new_damage[GPU_MAX_DAMAGE];
+    u32   n_new_damage;
+    Rect *r;
+    u32   i;
+    u32   b;
+    u64   off;
+
+    b = state->back;
+
+    memcpy(new_damage, state->damage, sizeof(new_damage));
+    n_new_damage = state->n_damage;
+
+    for (i = 0; i < state->n_prev_damage; i += 1) {
+        r = &state->prev_damage[i];
+        add_damage(state, r->x, r->y, r->w, r->h);
     }
 
+    for (i = 0; i < state->n_damage; i += 1) {
+        r = &state->damage[i];
 
-    response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_CREATE_2D,
-                       1, /* resource_id */
-                       R8G8B8A8_UNORM,
-                       state->display.rect.w,
-                       state->display.rect.h);
-    kfree(response);
+        /* The offset locates the rectangle's first pixel in the backing store. */
+        queue_cmd(state, b, VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D,
+                  RECT_AS_ARGS((*r)),
+                  4 * ((u64)r->y * state->display.rect.w + r->x), /* offset */
+                  b + 1 /* resource_id */);
+    }
 
-    state->fb_size = state->display.rect.w * state->display.rect.h;
-    state->fb = kmalloc(4 * state->fb_size);
+    /* The control queue is processed in order, so these see the transfers above. */
+    queue_cmd(state, b, VIRTIO_GPU_CMD_SET_SCANOUT,
+              RECT_AS_ARGS(state->display.rect),
+              0, /* scanout_id */
+              b + 1 /* resource_id */);
 
-    for (u64 i = 0; i < state->fb_size; i += 1) {
-/*         state->fb[i] = (i * i) | 0xFF000000; */
-        state->fb[i] = 0xFF000000;
+    for (i = 0; i < state->n_damage; i += 1) {
+        r = &state->damage[i];
+
+        queue_cmd(state, b, VIRTIO_GPU_CMD_RESOURCE_FLUSH,
+                  RECT_AS_ARGS((*r)),
+                  b + 1 /* resource_id */);
     }
 
+    kick(state);
 
-    response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING,
-                       1, /* resource_id */
-                       1, /* n_entries   */
-                       virt_to_phys(kernel_pt, (u64)state->fb),
-                       4 * state->fb_size);
-    kfree(response);
+    state->back = 1 - b;
+    state->fb   = state->fbs[state->back];
 
-    response = gpu_cmd(state, VIRTIO_GPU_CMD_SET_SCANOUT,
-                       RECT_AS_ARGS(state->display.rect),
-                       0, /* scanout_id */
-                       1 /* resource_id */);
-    kfree(response);
+    wait_buffer(state, state->back);
 
-    do_flush(state);
+    for (i = 0; i < n_new_damage; i += 1) {
+        r = &new_damage[i];
 
-    event.type = EV_DISP;
-    input_push(&event);
+        off = (u64)r->y * state->display.rect.w + r->x;
+        blit_copy(state->fbs[state->back] + off, state->display.rect.w,
+                  state->fbs[b] + off,           state->display.rect.w,
+                  r->w, r->h);
+    }
 
+    memcpy(state->prev_damage, new_damage, sizeof(new_damage));
+    state->n_prev_damage = n_new_damage;
+    state->n_damage      = 0;
+}
+
+/* Blacks out everything in a w x h framebuffer outside its top-left cw x ch. */
+static void pad_fb(u32 *fb, u32 cw, u32 ch, u32 w, u32 h) {
+    if (cw < w) {
+        blit_fill(fb + cw, w, w - cw, ch, 0xFF000000);
+    }
+    if (ch < h) {
+        blit_fill(fb + (u64)ch * w, w, w, h - ch, 0xFF000000);
+    }
+}
+
+/*
+ * Moves a framebuffer's contents from an old_w x old_h layout to w x h in
+ * place, cropping or padding with black. Rows that get shorter move forward
+ * from the top and rows that get longer move back from the bottom, so no row
+ * is overwritten before it has been moved.
+ */
+static void relayout_fb(u32 *fb, u32 old_w, u32 old_h, u32 w, u32 h) {
+    u32  cw;
+    u32  ch;
+    u32  y;
+    u32  x;
+    u32 *dst;
+    u32 *src;
+
+    cw = MIN(w, old_w);
+    ch = MIN(h, old_h);
+
+    if (w <= old_w) {
+        for (y = 1; y < ch; y += 1) {
+            dst = fb + (u64)y * w;
+            src = fb + (u64)y * old_w;
+            for (x = 0; x < cw; x += 1) { dst[x] = src[x]; }
+        }
+    } else {
+        for (y = ch; y > 1; y -= 1) {
+            dst = fb + (u64)(y - 1) * w;
+            src = fb + (u64)(y - 1) * old_w;
+            for (x = cw; x > 0; x -= 1) { dst[x - 1] = src[x - 1]; }
+        }
+    }
+
+    pad_fb(fb, cw, ch, w, h);
+}
+
+/*
+ * Rebuilds both framebuffer resources at the current display size. The
+ * backing stores are only reallocated when they have to grow and keep what
+ * was on screen either way. None of the resource commands are waited on: the
+ * control queue runs in order, so they are queued against their buffer and
+ * go out with the first present at the new size.
+ */
+static void resize_fbs(GPU_State *state, u32 old_w, u32 old_h) {
+    u32 *fb;
+    u32  w;
+    u32  h;
+    u32  b;
+
+    w = state->display.rect.w;
+    h = state->display.rect.h;
+
+    state->fb_size = (u64)w * h;
+
+    for (b = 0; b < 2; b += 1) {
+        if (state->fbs[b] != NULL) {
+            queue_cmd(state, b, VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING, b + 1 /* resource_id */);
+            queue_cmd(state, b, VIRTIO_GPU_CMD_RESOURCE_UNREF,          b + 1 /* resource_id */);
+        }
+
+        /* Resource 1 is backed by fbs[0] and resource 2 by fbs[1]. */
+        queue_cmd(state, b, VIRTIO_GPU_CMD_RESOURCE_CREATE_2D,
+                  b + 1, /* resource_id */
+                  R8G8B8A8_UNORM,
+                  w,
+                  h);
+
+        if (state->fb_size > state->fb_cap) {
+            /*
+             * Only transfers read the backing, and there are none in flight,
+             * so the old one can go before the detach is processed.
+             */
+            fb = kmalloc(4 * state->fb_size);
+
+            if (state->fbs[b] != NULL) {
+                blit_copy(fb, w, state->fbs[b], old_w, MIN(w, old_w), MIN(h, old_h));
+                kfree(state->fbs[b]);
+            }
+
+            state->fbs[b] = fb;
+
+            pad_fb(fb, MIN(w, old_w), MIN(h, old_h), w, h);
+        } else {
+            relayout_fb(state->fbs[b], old_w, old_h, w, h);
+        }
+
+        queue_cmd(state, b, VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING,
+                  b + 1, /* resource_id */
+                  1,     /* n_entries   */
+                  virt_to_phys(kernel_pt, (u64)state->fbs[b]),
+                  4 * state->fb_size);
+    }
+
+    state->fb_cap = MAX(state->fb_cap, state->fb_size);
+    state->fb     = state->fbs[state->back];
+}
+
+/*
+ * Display info is only asked for when the device reports a change (or the
+ * display is reset by hand), and the resources are only rebuilt if that
+ * changed the mode. With force they are rebuilt regardless.
+ */
+static void do_reset_display(GPU_State *state, u32 force) {
+    Display_Info_Reponse *display_info;
+    Input_Event           event;
+    u32                   old_w;
+    u32                   old_h;
+
+    /* Transfers still in flight read the framebuffers at the old layout. */
+    drain_cmds(state);
+
+    /* Cleared first so a change that lands during the query isn't lost. */
     state->display_updated = 0;
+
+    old_w = state->display.rect.w;
+    old_h = state->display.rect.h;
+
+    display_info = gpu_cmd(state, VIRTIO_GPU_CMD_GET_DISPLAY_INFO);
+    memcpy(&state->display, &display_info->displays[0], sizeof(state->display));
+
+    kfree(display_info);
+
+    if (!force
+    &&  state->display.rect.w == old_w
+    &&  state->display.rect.h == old_h) {
+
+        return;
+    }
+
+    resize_fbs(state, old_w, old_h);
+
+    /*
+     * Neither resource has seen anything yet. The back buffer has the newest
+     * contents, so it goes out whole and is copied to the other one.
+     */
+    damage_all(state);
+    memcpy(state->prev_damage, state->damage, sizeof(state->damage));
+    state->n_prev_damage = state->n_damage;
+
+    present(state);
+
+    event.type = EV_DISP;
+    input_push(&event);
 }
 
 
 static DRV_INIT_FN(init, drv_state) {
     GPU_State            *state;
-    u32                   queue_size;
 
     state = kmalloc(sizeof(GPU_State));
     memset(state, 0, sizeof(*state));
@@ -523,38 +956,36 @@ static DRV_INIT_FN(init, drv_state) {
     state->vio_info.pci_common->device_status  = VIRTIO_DEV_STATUS_RESET;
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_ACKNOWLEDGE;
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_DRIVER;
-    state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_FEATURES_OK;
-
-    state->vio_info.pci_common->queue_select = 0;
-
-    queue_size = state->vio_info.pci_common->queue_size;
 
-    state->vio_info.descriptor_table         = kmalloc(16 * queue_size);
-    memset(state->vio_info.descriptor_table, 0, 16 * queue_size);
-    state->vio_info.pci_common->queue_desc   = virt_to_phys(kernel_pt, (u64)state->vio_info.descriptor_table);
-    state->vio_info.desc_idx                 = 0;
+    virtio_negotiate_features(&state->vio_info, VIRTIO_FEATURE(VIRTIO_F_RING_PACKED));
 
-    state->vio_info.driver_ring              = kmalloc(6 + 2 * queue_size);
-    memset(state->vio_info.driver_ring, 0, 6 + 2 * queue_size);
-    state->vio_info.pci_common->queue_driver = virt_to_phys(kernel_pt, (u64)state->vio_info.driver_ring);
+    state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_FEATURES_OK;
 
-    state->vio_info.device_ring              = kmalloc(6 + 8 * queue_size);
-    memset(state->vio_info.device_ring, 0, 6 + 8 * queue_size);
-    state->vio_info.pci_common->queue_device = virt_to_phys(kernel_pt, (u64)state->vio_info.device_ring);
-    state->vio_info.used_idx                 = 0;
+    if (!(state->vio_info.pci_common->device_status & VIRTIO_DEV_STATUS_FEATURES_OK)) {
+        kprint("virtio-gpu: device rejected features\n");
+        return -1;
+    }
 
+    if (virtio_queue_init(&state->vio_info, &state->queue, 0) != 0) {
+        kprint("virtio-gpu: could not set up control queue\n");
+        return -1;
+    }
 
-    state->vio_info.pci_common->queue_enable = 1;
+    if (virtio_queue_init(&state->vio_info, &state->cursor_queue, 1) != 0) {
+        kprint("virtio-gpu: could not set up cursor queue\n");
+        return -1;
+    }
 
     state->vio_info.pci_common->device_status |= VIRTIO_DEV_STATUS_DRIVER_OK;
 
-    do_reset_display(state);
+    do_reset_display(state, 1);
 
     return 0;
 }
 
 static DRV_IRQ_FN(irq, drv_state) {
-    GPU_State *state;
+    GPU_State    *state;
+    volatile u32 *done;
 
     state = drv_state->data;
 
@@ -565,10 +996,12 @@ static DRV_IRQ_FN(irq, drv_state) {
             state->display_updated = 1;
         }
 
-        while (state->vio_info.used_idx != state->vio_info.device_ring->idx) {
-            state->cmd_pending = 0;
+        while ((done = virtio_queue_pop_used(&state->queue, NULL)) != NULL) {
+            *done = 1;
+        }
 
-            state->vio_info.used_idx += 1;
+        while ((done = virtio_queue_pop_used(&state->cursor_queue, NULL)) != NULL) {
+            *done = 1;
         }
 
         return 0;
@@ -582,20 +1015,19 @@ static DRV_GPU_RESET_DISPLAY_FN(reset_display, drv_state) {
 
     state = drv_state->data;
 
-    do_reset_display(state);
+    do_reset_display(state, 1);
 
     return 0;
 }
 
 static DRV_GPU_CLEAR_FN(clear, drv_state, rgba_color) {
     GPU_State *state;
-    u64        i;
 
     state = drv_state->data;
 
-    for (i = 0; i < state->fb_size; i += 1) {
-        state->fb[i] = rgba_color;
-    }
+    blit_fill(state->fb, state->display.rect.w, state->display.rect.w, state->display.rect.h, rgba_color);
+
+    damage_all(state);
 
     return 0;
 }
@@ -613,34 +1045,39 @@ static DRV_GPU_GET_RECT_FN(get_rect, drv_state, x, y, w, h) {
     return 0;
 }
 
-static DRV_GPU_PIXELS_FN(pixels, drv_state, x, y, w, h, pixels) {
+static DRV_GPU_PIXELS_FN(pixels, drv_state, x, y, w, h, stride, pixels) {
     GPU_State *state;
-    u64        X;
-    u64        Y;
+    u32        cw;
+    u32        ch;
 
     state = drv_state->data;
 
-    for (X = 0; X < w && x + X < state->display.rect.w; X += 1) {
-        for (Y = 0; Y < h && y + Y < state->display.rect.h; Y += 1) {
-            state->fb[(y + Y) * state->display.rect.w + (x + X)] = pixels[X * w + Y];
-        }
-    }
+    if (x >= state->display.rect.w || y >= state->display.rect.h) { return 0; }
+
+    /* Only the part that is on screen gets copied. */
+    cw = MIN(w, state->display.rect.w - x);
+    ch = MIN(h, state->display.rect.h - y);
+
+    blit_copy(state->fb + (u64)y * state->display.rect.w + x, state->display.rect.w, pixels, stride, cw, ch);
+
+    add_damage(state, x, y, cw, ch);
 
     return 0;
 }
 
 static DRV_GPU_RECT_FN(rect, drv_state, x, y, w, h, rgba_color) {
     GPU_State *state;
-    u64        X;
-    u64        Y;
 
     state = drv_state->data;
 
-    for (X = 0; X < w && x + X < state->display.rect.w; X += 1) {
-        for (Y = 0; Y < h && y + Y < state->display.rect.h; Y += 1) {
-            state->fb[(y + Y) * state->display.rect.w + (x + X)] = rgba_color;
-        }
-    }
+    if (x >= state->display.rect.w || y >= state->display.rect.h) { return 0; }
+
+    w = MIN(w, state->display.rect.w - x);
+    h = MIN(h, state->display.rect.h - y);
+
+    blit_fill(state->fb + (u64)y * state->display.rect.w + x, state->display.rect.w, w, h, rgba_color);
+
+    add_damage(state, x, y, w, h);
 
     return 0;
 }
@@ -651,10 +1088,80 @@ static DRV_GPU_COMMIT_FN(commit, drv_state) {
     state = drv_state->data;
 
     if (state->display_updated) {
-        do_reset_display(state);
-    } else {
-        do_flush(state);
+        do_reset_display(state, 0);
     }
 
+    if (state->n_damage > 0) {
+        present(state);
+    }
+
+    return 0;
+}
+
+/*
+ * The image lives in its own resource. Updating it means a transfer on the
+ * control queue, which has to land before the cursor queue's UPDATE_CURSOR
+ * points the device at it, so that one command is waited for.
+ */
+static DRV_GPU_SET_CURSOR_FN(set_cursor, drv_state, pixels, hot_x, hot_y) {
+    GPU_State      *state;
+    Control_Header *response;
+
+    state = drv_state->data;
+
+    spin_lock(&state->cursor_lock);
+
+    if (state->cursor == NULL) {
+        response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_CREATE_2D,
+                           CURSOR_RESOURCE_ID,
+                           R8G8B8A8_UNORM,
+                           GPU_CURSOR_SIZE,
+                           GPU_CURSOR_SIZE);
+        kfree(response);
+
+        state->cursor = kmalloc(4 * GPU_CURSOR_SIZE * GPU_CURSOR_SIZE);
+
+        response = gpu_cmd(state, VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING,
+                           CURSOR_RESOURCE_ID,
+                           1, /* n_entries */
+                           virt_to_phys(kernel_pt, (u64)state->cursor),
+                           4 * GPU_CURSOR_SIZE * GPU_CURSOR_SIZE);
+        kfree(response);
+    }
+
+    blit_copy(state->cursor, GPU_CURSOR_SIZE, pixels, GPU_CURSOR_SIZE, GPU_CURSOR_SIZE, GPU_CURSOR_SIZE);
+
+    response = gpu_cmd(state, VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D,
+                       0, 0, GPU_CURSOR_SIZE, GPU_CURSOR_SIZE,
+                       0, /* offset */
+                       CURSOR_RESOURCE_ID);
+    kfree(response);
+
+    queue_cursor_cmd(state, VIRTIO_GPU_CMD_UPDATE_CURSOR, state->cursor_x, state->cursor_y, hot_x, hot_y);
+
+    spin_unlock(&state->cursor_lock);
+
+    return 0;
+}
+
+static DRV_GPU_MOVE_CURSOR_FN(move_cursor, drv_state, x, y) {
+    GPU_State *state;
+
+    state = drv_state->data;
+
+    spin_lock(&state->cursor_lock);
+
+    state->cursor_x = x;
+    state->cursor_y = y;
+
+    if (state->cursor == NULL) {
+        spin_unlock(&state->cursor_lock);
+        return -1;
+    }
+
+    queue_cursor_cmd(state, VIRTIO_GPU_CMD_MOVE_CURSOR, x, y, 0, 0);
+
+    spin_unlock(&state->cursor_lock);
+
     return 0;
 }
@@ -5,6 +5,7 @@
 #include "kmalloc.h"
 #include "array.h"
 #include "blk.h"
+#include "kprint.h"
 
 static s64 identify(u32 adid);
 static s64 mount(u32 adid, File *mount_point);
@@ -12,6 +13,10 @@ static s64 create(File *dir, const char *name, u32 kind);
 static s64 read(File *file, u8 *dst, u64 offset, u64 n_bytes);
 static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes);
 static s64 size(File *file);
+static s64 populate(File *dir);
+static s64 lookup(File *dir, const char *name);
+static s64 open(File *file);
+static s64 release(File *file);
 
 static FS_Impl impl = {
     .name     = "ext4",
@@ -21,6 +26,10 @@ static FS_Impl impl = {
     .read     = read,
     .write    = write,
     .size     = size,
+    .populate = populate,
+    .lookup   = lookup,
+    .open     = open,
+    .release  = release,
 };
 
 
@@ -192,12 +201,120 @@ typedef struct {
     u32    s_checksum;                                   /* crc32c(superblock)                 */
 } Super_Block;
 
+#define EXT4_FEATURE_INCOMPAT_FILETYPE  (0x0002)
+#define EXT4_FEATURE_INCOMPAT_RECOVER   (0x0004)
+#define EXT4_FEATURE_INCOMPAT_META_BG   (0x0010)
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   (0x0040)
+#define EXT4_FEATURE_INCOMPAT_64BIT     (0x0080)
+#define EXT4_FEATURE_INCOMPAT_MMP       (0x0100)
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG   (0x0200)
+#define EXT4_FEATURE_INCOMPAT_EA_INODE  (0x0400)
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED (0x2000)
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR  (0x4000)
 
+/* Everything else in the incompat set changes the on-disk layout in ways we can't read. */
+#define EXT4_FEATURE_INCOMPAT_SUPPORTED    \
+    ( EXT4_FEATURE_INCOMPAT_FILETYPE       \
+    | EXT4_FEATURE_INCOMPAT_RECOVER        \
+    | EXT4_FEATURE_INCOMPAT_EXTENTS        \
+    | EXT4_FEATURE_INCOMPAT_64BIT          \
+    | EXT4_FEATURE_INCOMPAT_MMP            \
+    | EXT4_FEATURE_INCOMPAT_FLEX_BG        \
+    | EXT4_FEATURE_INCOMPAT_EA_INODE       \
+    | EXT4_FEATURE_INCOMPAT_CSUM_SEED      \
+    | EXT4_FEATURE_INCOMPAT_LARGEDIR)
 
+#define EXT4_ROOT_INO      (2)
+#define EXT4_EXTENTS_FL    (0x80000)
+#define EXT4_EXT_MAGIC     (0xF30A)
+#define EXT4_EXT_INIT_MAX  (32768)
+#define EXT4_FT_DIR        (2)
 
 typedef struct {
-    u32         adid;
-    Super_Block sb;
+    u32 bg_block_bitmap_lo;
+    u32 bg_inode_bitmap_lo;
+    u32 bg_inode_table_lo;
+    u16 bg_free_blocks_count_lo;
+    u16 bg_free_inodes_count_lo;
+    u16 bg_used_dirs_count_lo;
+    u16 bg_flags;
+    u32 bg_exclude_bitmap_lo;
+    u16 bg_block_bitmap_csum_lo;
+    u16 bg_inode_bitmap_csum_lo;
+    u16 bg_itable_unused_lo;
+    u16 bg_checksum;
+    /* Only present when s_desc_size >= 64 (INCOMPAT_64BIT). */
+    u32 bg_block_bitmap_hi;
+    u32 bg_inode_bitmap_hi;
+    u32 bg_inode_table_hi;
+    u16 bg_free_blocks_count_hi;
+    u16 bg_free_inodes_count_hi;
+    u16 bg_used_dirs_count_hi;
+    u16 bg_itable_unused_hi;
+    u32 bg_exclude_bitmap_hi;
+    u16 bg_block_bitmap_csum_hi;
+    u16 bg_inode_bitmap_csum_hi;
+    u32 bg_reserved;
+} Group_Desc;
+
+typedef struct {
+    u16 i_mode;
+    u16 i_uid;
+    u32 i_size_lo;
+    u32 i_atime;
+    u32 i_ctime;
+    u32 i_mtime;
+    u32 i_dtime;
+    u16 i_gid;
+    u16 i_links_count;
+    u32 i_blocks_lo;
+    u32 i_flags;
+    u32 i_osd1;
+    u32 i_block[15];
+    u32 i_generation;
+    u32 i_file_acl_lo;
+    u32 i_size_high;
+    u32 i_obso_faddr;
+    u8  i_osd2[12];
+} Inode;
+
+typedef struct {
+    u16 eh_magic;
+    u16 eh_entries;
+    u16 eh_max;
+    u16 eh_depth;     /* 0 means the entries are leaves (Extent). */
+    u32 eh_generation;
+} Extent_Header;
+
+typedef struct {
+    u32 ei_block;     /* First logical block covered by this subtree. */
+    u32 ei_leaf_lo;
+    u16 ei_leaf_hi;
+    u16 ei_unused;
+} Extent_Index;
+
+typedef struct {
+    u32 ee_block;     /* First logical block. */
+    u16 ee_len;       /* > EXT4_EXT_INIT_MAX means allocated but unwritten. */
+    u16 ee_start_hi;
+    u32 ee_start_lo;
+} Extent;
+
+typedef struct {
+    u32 inode;
+    u16 rec_len;
+    u8  name_len;
+    u8  file_type;
+    char name[];
+} Dir_Entry;
+
+typedef struct {
+    u32          adid;
+    Super_Block  sb;
+    u64          block_size;
+    u32          n_groups;
+    u32          desc_size;
+    u8          *gdt;
 } Instance;
 
 static array_t instances;
@@ -208,13 +325,11 @@ void fs_ext4(void) {
 }
 
 
-static Super_Block *get_super_block(u32 adid) {
+static Instance *get_instance(u32 adid) {
     Instance **it;
 
     array_traverse(instances, it) {
-        if ((*it)->adid == adid) {
-            return &((*it)->sb);
-        }
+        if ((*it)->adid == adid) { return *it; }
     }
 
     return NULL;
@@ -230,6 +345,7 @@ static s64 identify(u32 adid) {
 
     if (sb.s_magic == 0xEF53) {
         inst = kmalloc(sizeof(*inst));
+        memset(inst, 0, sizeof(*inst));
         inst->adid = adid;
         memcpy(&inst->sb, &sb, sizeof(inst->sb));
         array_push(instances, inst);
@@ -239,20 +355,794 @@ static s64 identify(u32 adid) {
     return 0;
 }
 
+static Group_Desc *group_desc(Instance *inst, u32 group) {
+    return (Group_Desc*)(inst->gdt + (u64)group * inst->desc_size);
+}
+
+/*
+ * With flex_bg the inode tables of several groups are packed together at the
+ * start of the flex group rather than living in their own groups, but the
+ * descriptors always hold absolute block numbers, so nothing here needs to
+ * know about it.
+ */
+static u64 inode_table_block(Instance *inst, u32 group) {
+    Group_Desc *gd;
+    u64         block;
+
+    gd    = group_desc(inst, group);
+    block = gd->bg_inode_table_lo;
+
+    if (inst->desc_size >= 64) {
+        block |= (u64)gd->bg_inode_table_hi << 32;
+    }
+
+    return block;
+}
+
+static s64 read_inode(Instance *inst, u32 ino, Inode *inode) {
+    u32 group;
+    u32 index;
+    u64 off;
+
+    if (ino == 0 || ino > inst->sb.s_inodes_count) { return -1; }
+
+    group = (ino - 1) / inst->sb.s_inodes_per_group;
+    index = (ino - 1) % inst->sb.s_inodes_per_group;
+    off   = inode_table_block(inst, group) * inst->block_size
+          + (u64)index * inst->sb.s_inode_size;
+
+    return blk_read(inst->adid, off, (void*)inode, sizeof(*inode));
+}
+
+static u64 inode_size(Inode *inode) {
+    return inode->i_size_lo | ((u64)inode->i_size_high << 32);
+}
+
+/*
+ * Find the extent covering logical block lblock. On return, *pblock is the
+ * physical block it maps to (0 for a hole or an unwritten extent, which both
+ * read as zeroes) and *len is how many logical blocks from lblock on share
+ * that fate, so that a caller can move the whole run in one request.
+ */
+static s64 extent_map(Instance *inst, Inode *inode, u64 lblock, u64 *pblock, u64 *len) {
+    Extent_Header *hdr;
+    Extent_Index  *idx;
+    Extent        *ext;
+    u8            *node;
+    u64            next;
+    u64            child;
+    u32            i;
+    u32            ext_len;
+    s64            status;
+
+    hdr    = (Extent_Header*)inode->i_block;
+    node   = NULL;
+    next   = (u64)-1;
+    status = -1;
+
+    for (;;) {
+        if (hdr->eh_magic != EXT4_EXT_MAGIC) {
+            kprint("ext4: bad extent header\n");
+            goto out;
+        }
+
+        if (hdr->eh_depth == 0) { break; }
+
+        if (hdr->eh_entries == 0) {
+            *pblock = 0;
+            *len    = next - lblock;
+            status  = 0;
+            goto out;
+        }
+
+        idx = (Extent_Index*)(hdr + 1);
+
+        /* Last index whose subtree starts at or before lblock. */
+        for (i = 1; i < hdr->eh_entries && idx[i].ei_block <= lblock; i += 1);
+
+        if (i < hdr->eh_entries && idx[i].ei_block < next) {
+            next = idx[i].ei_block;
+        }
+
+        child = idx[i - 1].ei_leaf_lo | ((u64)idx[i - 1].ei_leaf_hi << 32);
+
+        if (node == NULL) { node = kmalloc(inst->block_size); }
+
+        if (blk_read(inst->adid, child * inst->block_size, node, inst->block_size) != 0) {
+            goto out;
+        }
+
+        hdr = (Extent_Header*)node;
+    }
+
+    ext = (Extent*)(hdr + 1);
+
+    for (i = 0; i < hdr->eh_entries; i += 1) {
+        ext_len = ext[i].ee_len > EXT4_EXT_INIT_MAX
+                    ? ext[i].ee_len - EXT4_EXT_INIT_MAX
+                    : ext[i].ee_len;
+
+        if (lblock < ext[i].ee_block) {
+            next = MIN(next, ext[i].ee_block);
+            break;
+        }
+
+        if (lblock < (u64)ext[i].ee_block + ext_len) {
+            *pblock = ext[i].ee_len > EXT4_EXT_INIT_MAX
+                        ? 0
+                        : ((u64)ext[i].ee_start_hi << 32 | ext[i].ee_start_lo) + (lblock - ext[i].ee_block);
+            *len    = ext[i].ee_block + ext_len - lblock;
+            status  = 0;
+            goto out;
+        }
+    }
+
+    /* A hole, up to the next extent (or forever). */
+    *pblock = 0;
+    *len    = next - lblock;
+    status  = 0;
+
+out:;
+    if (node != NULL) { kfree(node); }
+
+    return status;
+}
+
+static s64 read_inode_data(Instance *inst, Inode *inode, u8 *dst, u64 offset, u64 n_bytes) {
+    array_t        pending;
+    Blk_Request   *rq;
+    Blk_Request  **rit;
+    u64            size;
+    u64            pblock;
+    u64            run;
+    u64            n;
+    s64            n_read;
+
+    if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+        kprint("ext4: only extent-mapped files are supported\n");
+        return -1;
+    }
+
+    size = inode_size(inode);
+
+    if (offset >= size) { return 0; }
+
+    n_bytes = MIN(n_bytes, size - offset);
+    n_read  = n_bytes;
+    pending = array_make(Blk_Request*);
+
+    /* Each extent (or the part of it we want) goes out as one request. */
+    while (n_bytes > 0) {
+        if (extent_map(inst, inode, offset / inst->block_size, &pblock, &run) != 0) {
+            n_read = -1;
+            break;
+        }
+
+        /* Holes past the last extent are "infinite". */
+        run = MIN(run, n_bytes / inst->block_size + 1);
+        n   = MIN(run * inst->block_size - offset % inst->block_size, n_bytes);
+
+        if (pblock == 0) {
+            memset(dst, 0, n);
+        } else {
+            rq = blk_read_async(inst->adid, pblock * inst->block_size + offset % inst->block_size, dst, n);
+            array_push(pending, rq);
+        }
+
+        offset  += n;
+        dst     += n;
+        n_bytes -= n;
+    }
+
+    array_traverse(pending, rit) {
+        if (blk_wait(inst->adid, *rit) != 0) { n_read = -1; }
+    }
+
+    array_free(pending);
+
+    return n_read;
+}
+
+static void mount_dir_entry(Instance *inst, Dir_Entry *entry, File *dir) {
+    char   name[256];
+    File  *f;
+    Inode  child;
+    u32    kind;
+
+    memcpy(name, entry->name, entry->name_len);
+    name[entry->name_len] = 0;
+
+    /* An earlier lookup may already have brought this one in. */
+    if (vfs_find_dir_entry(dir, name) != NULL) { return; }
+
+    if (inst->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_FILETYPE) {
+        kind = entry->file_type == EXT4_FT_DIR ? FILE_DIRECTORY : FILE_REGULAR;
+    } else {
+        if (read_inode(inst, entry->inode, &child) != 0) { return; }
+        kind = S_FMT(child.i_mode) == S_IFDIR ? FILE_DIRECTORY : FILE_REGULAR;
+    }
+
+    f        = vfs_new_file(name, kind, inst->adid);
+    f->inode = entry->inode;
+    f->fs    = FS_EXT4;
+
+    if (kind == FILE_DIRECTORY
+    &&  strcmp(name, ".")  != 0
+    &&  strcmp(name, "..") != 0) {
+        f->populated = 0;
+    }
+
+    vfs_add_dir_entry(dir, f);
+}
+
+static void mount_dir_entries(Instance *inst, Inode *inode, File *dir) {
+    u64        size;
+    u8        *data;
+    u64        off;
+    Dir_Entry *entry;
+
+    size = inode_size(inode);
+    data = kmalloc(size);
+
+    if (read_inode_data(inst, inode, data, 0, size) != (s64)size) {
+        kprint("ext4: could not read directory\n");
+        kfree(data);
+        return;
+    }
+
+    /*
+     * Entries never cross a block boundary and rec_len always gets us to the
+     * next one. Unused space, htree interior blocks and checksum tails all
+     * show up as entries with inode 0.
+     */
+    for (off = 0; off + sizeof(Dir_Entry) <= size; off += entry->rec_len) {
+        entry = (Dir_Entry*)(data + off);
+
+        if (entry->rec_len < sizeof(Dir_Entry)) { break; }
+        if (entry->inode == 0)                  { continue; }
+
+        mount_dir_entry(inst, entry, dir);
+    }
+
+    kfree(data);
+}
+
+/*
+ * Hashed directory index (htree). Block 0 of an indexed directory holds a
+ * dx_root after the "." and ".." entries; deeper index levels are dx_node
+ * blocks that look like one empty entry spanning the block. Both carry a
+ * sorted array of (hash, logical block) pairs whose first slot doubles as the
+ * limit/count header and implicitly has hash 0.
+ */
+
+#define EXT4_FEATURE_COMPAT_DIR_INDEX (0x0020)
+#define EXT4_INDEX_FL                 (0x1000)
+#define EXT2_FLAGS_UNSIGNED_HASH      (0x0002)
+#define EXT4_HTREE_EOF_32BIT          (0x7fffffffU)
+
+enum {
+    DX_HASH_LEGACY,
+    DX_HASH_HALF_MD4,
+    DX_HASH_TEA,
+    DX_HASH_LEGACY_UNSIGNED,
+    DX_HASH_HALF_MD4_UNSIGNED,
+    DX_HASH_TEA_UNSIGNED,
+};
+
+typedef struct {
+    u32 reserved_zero;
+    u8  hash_version;
+    u8  info_length;
+    u8  indirect_levels;
+    u8  unused_flags;
+} DX_Root_Info;
+
+typedef struct {
+    u32 hash;
+    u32 block;
+} DX_Entry;
+
+typedef struct {
+    u16 limit;
+    u16 count;
+    u32 block;
+} DX_Count_Limit;
+
+static u32 rol32(u32 x, u32 s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+static void tea_transform(u32 buf[4], const u32 in[4]) {
+    u32 sum;
+    u32 b0;
+    u32 b1;
+    u32 n;
+
+    sum = 0;
+    b0  = buf[0];
+    b1  = buf[1];
+
+    for (n = 0; n < 16; n += 1) {
+        sum += 0x9E3779B9;
+        b0  += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1  += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define MD4_ROUND(f, a, b, c, d, x, s) ((a) += f((b), (c), (d)) + (x), (a) = rol32((a), (s)))
+
+#define MD4_K1 (0)
+#define MD4_K2 (013240474631U)
+#define MD4_K3 (015666365641U)
+
+static void half_md4_transform(u32 buf[4], const u32 in[8]) {
+    u32 a;
+    u32 b;
+    u32 c;
+    u32 d;
+
+    a = buf[0];
+    b = buf[1];
+    c = buf[2];
+    d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1,  3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1,  7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1,  3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1,  7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2,  3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2,  5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2,  9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2,  3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2,  5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2,  9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3,  3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3,  9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3,  3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3,  9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/* Characters are sign-extended for the "signed" hash variants, as on x86 where mkfs usually runs. */
+static s32 hash_char(const char *name, u32 i, u32 is_signed) {
+    return is_signed ? (s32)(s8)name[i] : (s32)(u8)name[i];
+}
+
+static u32 legacy_hash(const char *name, u32 len, u32 is_signed) {
+    u32 hash;
+    u32 hash0;
+    u32 hash1;
+    u32 i;
+
+    hash0 = 0x12a3fe2d;
+    hash1 = 0x37abe8f9;
+
+    for (i = 0; i < len; i += 1) {
+        hash = hash1 + (hash0 ^ (u32)(hash_char(name, i, is_signed) * 7152373));
+
+        if (hash & 0x80000000) { hash -= 0x7fffffff; }
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, s32 len, u32 *buf, s32 num, u32 is_signed) {
+    u32 pad;
+    u32 val;
+    s32 i;
+
+    pad  = (u32)len | ((u32)len << 8);
+    pad |= pad << 16;
+    val  = pad;
+
+    if (len > num * 4) { len = num * 4; }
+
+    for (i = 0; i < len; i += 1) {
+        val = (u32)hash_char(msg, i, is_signed) + (val << 8);
+
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val    = pad;
+            num   -= 1;
+        }
+    }
+
+    if (--num >= 0) { *buf++ = val; }
+    while (--num >= 0) { *buf++ = pad; }
+}
+
+static u32 dx_hash(Instance *inst, const char *name, u32 version) {
+    u32         buf[4];
+    u32         in[8];
+    u32         hash;
+    u32         is_signed;
+    s32         len;
+    const char *p;
+    u32         i;
+
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+
+    for (i = 0; i < 4; i += 1) {
+        if (inst->sb.s_hash_seed[i] != 0) {
+            memcpy(buf, inst->sb.s_hash_seed, sizeof(buf));
+            break;
+        }
+    }
+
+    if (version <= DX_HASH_TEA && (inst->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+        version += DX_HASH_LEGACY_UNSIGNED;
+    }
+
+    is_signed = version <= DX_HASH_TEA;
+    len       = strlen(name);
+    p         = name;
+
+    switch (version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = legacy_hash(name, len, is_signed);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            while (len > 0) {
+                str2hashbuf(p, len, in, 8, is_signed);
+                half_md4_transform(buf, in);
+                len -= 32;
+                p   += 32;
+            }
+            hash = buf[1];
+            break;
+        case DX_HASH_TEA:
+        case DX_HASH_TEA_UNSIGNED:
+            while (len > 0) {
+                str2hashbuf(p, len, in, 4, is_signed);
+                tea_transform(buf, in);
+                len -= 16;
+                p   += 16;
+            }
+            hash = buf[0];
+            break;
+        default:
+            return (u32)-1;
+    }
+
+    hash &= ~1;
+    if (hash == (EXT4_HTREE_EOF_32BIT << 1)) {
+        hash = (EXT4_HTREE_EOF_32BIT - 1) << 1;
+    }
+
+    return hash;
+}
+
+static s64 read_dir_block(Instance *inst, Inode *inode, u64 lblock, u8 *buf) {
+    return read_inode_data(inst, inode, buf, lblock * inst->block_size, inst->block_size) == (s64)inst->block_size
+            ? 0
+            : -1;
+}
+
+/*
+ * An index walk: the index block read at each level and the entry followed
+ * out of it. Level 0 is the root in block 0. Index entries carry flags in the
+ * top bits of their block numbers, hence DX_BLOCK().
+ */
+#define DX_MAX_LEVELS (3)
+#define DX_BLOCK(_b)  ((_b) & 0x0fffffff)
+
+typedef struct {
+    u32 levels;
+    u32 hash;
+    u64 blocks[DX_MAX_LEVELS];
+    u32 pos[DX_MAX_LEVELS];
+} DX_Path;
+
+/* Reads the index block for a level into block and returns its count/limit header, or NULL. */
+static DX_Count_Limit *dx_read_node(Instance *inst, Inode *inode, DX_Path *path, u32 level, u8 *block) {
+    DX_Root_Info   *info;
+    DX_Count_Limit *cl;
+
+    if (read_dir_block(inst, inode, path->blocks[level], block) != 0) { return NULL; }
+
+    if (level == 0) {
+        /* Skip the "." (12 bytes) and ".." (12 bytes) entries. */
+        info = (DX_Root_Info*)(block + 24);
+        cl   = (DX_Count_Limit*)((u8*)info + info->info_length);
+    } else {
+        /* dx_node: an empty 8-byte entry, then the count/limit header. */
+        cl = (DX_Count_Limit*)(block + 8);
+    }
+
+    if (cl->count == 0 || cl->count > cl->limit) { return NULL; }
+
+    return cl;
+}
+
+/* Walk the index down to the leaf block that must hold name if it exists. */
+static s64 dx_find_leaf(Instance *inst, Inode *inode, const char *name, DX_Path *path, u64 *leaf) {
+    u8             *block;
+    DX_Root_Info   *info;
+    DX_Count_Limit *cl;
+    DX_Entry       *entries;
+    u32             level;
+    u32             i;
+    s64             status;
+
+    block  = kmalloc(inst->block_size);
+    status = -1;
+
+    if (read_dir_block(inst, inode, 0, block) != 0) { goto out; }
+
+    info = (DX_Root_Info*)(block + 24);
+
+    if (info->reserved_zero   != 0
+    ||  info->info_length     <  sizeof(*info)
+    ||  info->indirect_levels >= DX_MAX_LEVELS) {
+
+        goto out;
+    }
+
+    if ((path->hash = dx_hash(inst, name, info->hash_version)) == (u32)-1) { goto out; }
+
+    path->levels    = info->indirect_levels + 1;
+    path->blocks[0] = 0;
+
+    for (level = 0; level < path->levels; level += 1) {
+        if ((cl = dx_read_node(inst, inode, path, level, block)) == NULL) { goto out; }
+
+        entries = (DX_Entry*)cl;
+
+        /* Last entry whose hash is <= ours. entries[0] covers everything below entries[1]. */
+        for (i = 1; i < cl->count && entries[i].hash <= path->hash; i += 1);
+
+        path->pos[level] = i - 1;
+        *leaf            = DX_BLOCK(entries[i - 1].block);
+
+        if (level + 1 < path->levels) {
+            path->blocks[level + 1] = *leaf;
+        }
+    }
+
+    status = 0;
+
+out:;
+    kfree(block);
+
+    return status;
+}
+
+/*
+ * Moves path on to the next leaf if it continues the current one's run of
+ * colliding hashes, which the low bit of the next index hash marks. The next
+ * entry may be in a parent node when the current one is the last in its
+ * node, in which case the walk goes back down along the first entries.
+ * Returns 1 and the leaf if there is one, 0 if not and -1 on error.
+ */
+static s64 dx_next_leaf(Instance *inst, Inode *inode, DX_Path *path, u64 *leaf) {
+    u8             *block;
+    DX_Count_Limit *cl;
+    DX_Entry       *entries;
+    s32             level;
+    u32             hash;
+    s64             status;
+
+    block  = kmalloc(inst->block_size);
+    status = -1;
+
+    for (level = path->levels - 1; level >= 0; level -= 1) {
+        if ((cl = dx_read_node(inst, inode, path, level, block)) == NULL) { goto out; }
+
+        if (path->pos[level] + 1 < cl->count) { break; }
+    }
+
+    if (level < 0) {
+        status = 0;
+        goto out;
+    }
+
+    entries            = (DX_Entry*)cl;
+    path->pos[level]  += 1;
+    hash               = entries[path->pos[level]].hash;
+    *leaf              = DX_BLOCK(entries[path->pos[level]].block);
+
+    if (!(hash & 1) || (hash & ~1) != path->hash) {
+        status = 0;
+        goto out;
+    }
+
+    for (level += 1; level < (s32)path->levels; level += 1) {
+        path->blocks[level] = *leaf;
+        path->pos[level]    = 0;
+
+        if ((cl = dx_read_node(inst, inode, path, level, block)) == NULL) { goto out; }
+
+        *leaf = DX_BLOCK(((DX_Entry*)cl)[0].block);
+    }
+
+    status = 1;
+
+out:;
+    kfree(block);
+
+    return status;
+}
+
+static Dir_Entry *find_in_block(u8 *block, u64 len, const char *name) {
+    u64        off;
+    Dir_Entry *entry;
+    u64        name_len;
+
+    name_len = strlen(name);
+
+    for (off = 0; off + sizeof(Dir_Entry) <= len; off += entry->rec_len) {
+        entry = (Dir_Entry*)(block + off);
+
+        if (entry->rec_len < sizeof(Dir_Entry)) { break; }
+
+        if (entry->inode    != 0
+        &&  entry->name_len == name_len
+        &&  strncmp(entry->name, name, name_len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static s64 lookup(File *dir, const char *name) {
+    Instance  *inst;
+    Inode      inode;
+    u8        *data;
+    u64        len;
+    Dir_Entry *entry;
+    DX_Path    path;
+    u64        leaf;
+
+    if ((inst = get_instance(dir->adid)) == NULL)   { return -1; }
+    if (read_inode(inst, dir->inode, &inode) != 0) { return -1; }
+
+    entry = NULL;
+
+    if ((inst->sb.s_feature_compat & EXT4_FEATURE_COMPAT_DIR_INDEX)
+    &&  (inode.i_flags & EXT4_INDEX_FL)
+    &&  dx_find_leaf(inst, &inode, name, &path, &leaf) == 0) {
+
+        len  = inst->block_size;
+        data = kmalloc(len);
+
+        /* A run of colliding hashes can go on for any number of leaves. */
+        do {
+            if (read_dir_block(inst, &inode, leaf, data) != 0) { break; }
+
+            entry = find_in_block(data, len, name);
+        } while (entry == NULL && dx_next_leaf(inst, &inode, &path, &leaf) == 1);
+    } else {
+        len  = inode_size(&inode);
+        data = kmalloc(len);
+
+        if (read_inode_data(inst, &inode, data, 0, len) == (s64)len) {
+            entry = find_in_block(data, len, name);
+        }
+    }
+
+    if (entry != NULL) {
+        mount_dir_entry(inst, entry, dir);
+    }
+
+    kfree(data);
+
+    return entry == NULL ? -1 : 0;
+}
+
+static s64 populate(File *dir) {
+    Instance *inst;
+    Inode     inode;
+
+    if ((inst = get_instance(dir->adid)) == NULL) { return -1; }
+
+    if (read_inode(inst, dir->inode, &inode) != 0) { return -1; }
+
+    mount_dir_entries(inst, &inode, dir);
+
+    return 0;
+}
+
 static s64 mount(u32 adid, File *mount_point) {
-    Super_Block *sb;
+    Instance *inst;
+    u64       gdt_len;
+    u32       unsupported;
+    Inode     root;
 
-    if ((sb = get_super_block(adid)) == NULL) { return -1; }
+    if ((inst = get_instance(adid)) == NULL) { return -1; }
 
-    return -1;
+    unsupported = inst->sb.s_feature_incompat & ~EXT4_FEATURE_INCOMPAT_SUPPORTED;
+    if (unsupported) {
+        kprint("ext4: unsupported incompatible features 0x%x\n", unsupported);
+        return -1;
+    }
+
+    inst->block_size = 1024ULL << inst->sb.s_log_block_size;
+    inst->n_groups   = (inst->sb.s_blocks_count - inst->sb.s_first_data_block + inst->sb.s_blocks_per_group - 1)
+                     / inst->sb.s_blocks_per_group;
+    inst->desc_size  = (inst->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+                        ? inst->sb.s_desc_size
+                        : 32;
+
+    if (inst->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        inst->n_groups = ((((u64)inst->sb.s_blocks_count_hi << 32) | inst->sb.s_blocks_count)
+                          - inst->sb.s_first_data_block + inst->sb.s_blocks_per_group - 1)
+                       / inst->sb.s_blocks_per_group;
+    }
+
+    /* The descriptor table starts in the block after the superblock. */
+    gdt_len   = ALIGN((u64)inst->n_groups * inst->desc_size, inst->block_size);
+    inst->gdt = kmalloc(gdt_len);
+
+    if (blk_read(inst->adid, (inst->sb.s_first_data_block + 1) * inst->block_size, inst->gdt, gdt_len) != 0) {
+        return -1;
+    }
+
+    if (read_inode(inst, EXT4_ROOT_INO, &root) != 0
+    ||  S_FMT(root.i_mode) != S_IFDIR) {
+        kprint("ext4: root inode is not a directory\n");
+        return -1;
+    }
+
+    mount_dir_entries(inst, &root, mount_point);
+
+    return 0;
 }
 
 static s64 create(File *dir, const char *name, u32 kind) {
     return -1;
 }
 
+/* Nothing here is ever written, so an open file can keep its inode for good. */
+static s64 file_inode(Instance *inst, File *file, Inode *inode) {
+    if (file->fs_data != NULL) {
+        memcpy(inode, file->fs_data, sizeof(*inode));
+        return 0;
+    }
+
+    return read_inode(inst, file->inode, inode);
+}
+
 static s64 read(File *file, u8 *dst, u64 offset, u64 n_bytes) {
-    return -1;
+    Instance *inst;
+    Inode     inode;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+
+    if (file_inode(inst, file, &inode) != 0) { return -1; }
+
+    return read_inode_data(inst, &inode, dst, offset, n_bytes);
 }
 
 static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes) {
@@ -260,5 +1150,37 @@ static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes) {
 }
 
 static s64 size(File *file) {
-    return -1;
+    Instance *inst;
+    Inode     inode;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+
+    if (file_inode(inst, file, &inode) != 0) { return -1; }
+
+    return inode_size(&inode);
+}
+
+static s64 open(File *file) {
+    Instance *inst;
+    Inode    *inode;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+
+    inode = kmalloc(sizeof(*inode));
+
+    if (read_inode(inst, file->inode, inode) != 0) {
+        kfree(inode);
+        return -1;
+    }
+
+    file->fs_data = inode;
+
+    return 0;
+}
+
+static s64 release(File *file) {
+    kfree(file->fs_data);
+    file->fs_data = NULL;
+
+    return 0;
 }
@@ -6,6 +6,7 @@
 #include "array.h"
 #include "blk.h"
 #include "kprint.h"
+#include "lock.h"
 
 static s64 identify(u32 adid);
 static s64 mount(u32 adid, File *mount_point);
@@ -13,6 +14,10 @@ static s64 create(File *dir, const char *name, u32 kind);
 static s64 read(File *file, u8 *dst, u64 offset, u64 n_bytes);
 static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes);
 static s64 size(File *file);
+static s64 populate(File *dir);
+static s64 sync(File *file);
+static s64 open(File *file);
+static s64 release(File *file);
 
 static FS_Impl impl = {
     .name     = "minix3",
@@ -22,6 +27,10 @@ static FS_Impl impl = {
     .read     = read,
     .write    = write,
     .size     = size,
+    .populate = populate,
+    .sync     = sync,
+    .open     = open,
+    .release  = release,
 };
 
 typedef struct {
@@ -65,9 +74,20 @@ typedef struct {
     + ((sb).zmap_blocks * (sb).block_size))
 
 
+#define IMAP_OFFSET(sb) (1024ULL + (sb).block_size)
+#define ZMAP_OFFSET(sb) (IMAP_OFFSET(sb) + (sb).imap_blocks * (sb).block_size)
+
+
 typedef struct {
-    u32         adid;
-    Super_Block sb;
+    u32          adid;
+    Super_Block  sb;
+    Spinlock     alloc_lock;
+    u64         *imap;
+    u64         *zmap;
+    u64          ihint;       /* Word of the map to start the next search at. */
+    u64          zhint;
+    u8          *imap_dirty;  /* One flag per bitmap block. */
+    u8          *zmap_dirty;
 } Instance;
 
 
@@ -99,6 +119,7 @@ static s64 identify(u32 adid) {
 
     if (sb.magic == 0x4D5A) {
         inst = kmalloc(sizeof(*inst));
+        memset(inst, 0, sizeof(*inst));
         inst->adid = adid;
         memcpy(&inst->sb, &sb, sizeof(inst->sb));
         array_push(instances, inst);
@@ -109,9 +130,588 @@ static s64 identify(u32 adid) {
 }
 
 
-static void mount_inode(Instance *inst, Inode *inode, Dir_Entry *entry, File *mount_point);
+/*
+ * Inode cache. Inodes are looked up by (adid, inum) and read a whole
+ * inode-table block at a time, so that the neighbours of an inode we had to
+ * fetch are already in memory when they're asked for. Callers hold a
+ * reference while they use an inode and mark it dirty when they change it;
+ * dirty inodes are written back when the last reference is dropped.
+ * Unreferenced inodes are evicted once the cache grows past ICACHE_MAX.
+ */
+
+#define ICACHE_BUCKETS (1024)
+#define ICACHE_MAX     (4096)
+
+typedef struct Cached_Inode {
+    struct Cached_Inode *next;
+    u32                  adid;
+    u32                  inum;
+    u32                  refs;
+    u32                  dirty;
+    Inode                inode;
+    Spinlock             wlock;        /* Serializes writes to the file/directory and flushing wbuf. */
+    array_t              wbuf;         /* Buffered_Block, sorted by fblock. See write(). */
+    u32                  pending_size; /* Size including buffered data not yet on disk. */
+} Cached_Inode;
+
+static Cached_Inode *icache[ICACHE_BUCKETS];
+static u32           icache_count;
+static u32           icache_evict_cursor;
+static Spinlock      icache_lock;
+
+static u32 icache_bucket(u32 adid, u32 inum) {
+    return ((adid * 0x9e3779b1) ^ inum) & (ICACHE_BUCKETS - 1);
+}
+
+/* Must be called with icache_lock held. */
+static Cached_Inode *icache_find(u32 adid, u32 inum) {
+    Cached_Inode *ci;
+
+    for (ci = icache[icache_bucket(adid, inum)]; ci != NULL; ci = ci->next) {
+        if (ci->adid == adid && ci->inum == inum) { return ci; }
+    }
+
+    return NULL;
+}
+
+/* Must be called with icache_lock held. */
+static void icache_evict(void) {
+    u32            scanned;
+    Cached_Inode **link;
+    Cached_Inode  *ci;
+
+    for (scanned = 0; scanned < ICACHE_BUCKETS && icache_count > ICACHE_MAX; scanned += 1) {
+        link = &icache[icache_evict_cursor];
+
+        while ((ci = *link) != NULL) {
+            /* Unreferenced inodes are never dirty; iput() already wrote them back. */
+            if (ci->refs == 0) {
+                *link         = ci->next;
+                icache_count -= 1;
+                if (ci->wbuf.elem_size != 0) { array_free(ci->wbuf); }
+                kfree(ci);
+            } else {
+                link = &ci->next;
+            }
+        }
+
+        icache_evict_cursor = (icache_evict_cursor + 1) & (ICACHE_BUCKETS - 1);
+    }
+}
+
+static u64 itable_block_offset(Instance *inst, u32 inum) {
+    return ALIGN_DOWN(OFFSET(inst->sb, inum), inst->sb.block_size);
+}
+
+/*
+ * Enter every inode from the table block at off that isn't cached yet. If want
+ * is nonzero, that inode is returned with a reference taken, so that it can't
+ * be evicted before the caller gets to it.
+ */
+static Cached_Inode *icache_fill(Instance *inst, u64 off, u8 *data, u32 want) {
+    u64           pos;
+    u32           inum;
+    u32           i;
+    Cached_Inode *ci;
+    u32           b;
+    Cached_Inode *wanted;
+
+    spin_lock(&icache_lock);
+
+    for (i = 0; i < inst->sb.block_size / sizeof(Inode); i += 1) {
+        /* The table doesn't have to start on a block boundary. */
+        pos = off + i * sizeof(Inode);
+        if (pos < OFFSET(inst->sb, 1)) { continue; }
+
+        inum = (pos - OFFSET(inst->sb, 1)) / sizeof(Inode) + 1;
+
+        if (inum > inst->sb.num_inodes)             { break;    }
+        if (icache_find(inst->adid, inum) != NULL) { continue; }
+
+        ci = kmalloc(sizeof(*ci));
+        memset(ci, 0, sizeof(*ci));
+
+        ci->adid  = inst->adid;
+        ci->inum  = inum;
+        ci->refs  = 0;
+        ci->dirty = 0;
+        memcpy(&ci->inode, data + i * sizeof(Inode), sizeof(Inode));
+
+        b             = icache_bucket(ci->adid, ci->inum);
+        ci->next      = icache[b];
+        icache[b]     = ci;
+        icache_count += 1;
+    }
+
+    wanted = NULL;
+    if (want != 0 && (wanted = icache_find(inst->adid, want)) != NULL) {
+        wanted->refs += 1;
+    }
+
+    if (icache_count > ICACHE_MAX) { icache_evict(); }
+
+    spin_unlock(&icache_lock);
+
+    return wanted;
+}
+
+static Cached_Inode *iget(Instance *inst, u32 inum) {
+    Cached_Inode *ci;
+    u8           *data;
+    u64           off;
+
+    if (inum == 0 || inum > inst->sb.num_inodes) {
+        kprint("minix3: bad inode number %u\n", inum);
+        return NULL;
+    }
+
+    spin_lock(&icache_lock);
+
+    if ((ci = icache_find(inst->adid, inum)) != NULL) {
+        ci->refs += 1;
+    }
+
+    spin_unlock(&icache_lock);
+
+    if (ci != NULL) { return ci; }
+
+    off  = itable_block_offset(inst, inum);
+    data = kmalloc(inst->sb.block_size);
+
+    blk_read(inst->adid, off, data, inst->sb.block_size);
+    ci = icache_fill(inst, off, data, inum);
+
+    kfree(data);
+
+    return ci;
+}
+
+static void imark_dirty(Cached_Inode *ci) {
+    ci->dirty = 1;
+}
+
+static void iput(Instance *inst, Cached_Inode *ci) {
+    Inode copy;
+    u32   write_back;
+
+    spin_lock(&icache_lock);
+
+    write_back = 0;
+
+    if (ci->refs == 1 && ci->dirty) {
+        memcpy(&copy, &ci->inode, sizeof(copy));
+        ci->dirty  = 0;
+        write_back = 1;
+    }
+
+    ci->refs -= 1;
+
+    spin_unlock(&icache_lock);
+
+    if (write_back) {
+        blk_write(inst->adid, OFFSET(inst->sb, ci->inum), (void*)&copy, sizeof(copy));
+    }
+}
+
+/* Writes back a dirty inode now rather than waiting for its last reference to go. */
+static s64 iwrite_back(Instance *inst, Cached_Inode *ci) {
+    Inode copy;
+    u32   write_back;
+
+    spin_lock(&icache_lock);
+
+    write_back = ci->dirty;
+
+    if (write_back) {
+        memcpy(&copy, &ci->inode, sizeof(copy));
+        ci->dirty = 0;
+    }
+
+    spin_unlock(&icache_lock);
+
+    if (!write_back) { return 0; }
+
+    if (blk_write(inst->adid, OFFSET(inst->sb, ci->inum), (void*)&copy, sizeof(copy)) != 0) {
+        imark_dirty(ci);
+        return -1;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    u64          offset;
+    u8          *data;
+    Blk_Request *rq;
+} Itable_Block;
+
+/*
+ * Make sure that the inodes of all of the given directory entries are cached,
+ * queuing the reads for every missing inode-table block together.
+ */
+static void icache_prefetch(Instance *inst, array_t entries) {
+    array_t       blocks;
+    Dir_Entry    *entry;
+    Itable_Block *it;
+    Itable_Block *hit;
+    Itable_Block  new;
+    u64           off;
+    u32           cached;
+
+    blocks = array_make(Itable_Block);
+    hit    = NULL;
+
+    array_traverse(entries, entry) {
+        off = itable_block_offset(inst, entry->inode);
+
+        /* Entries tend to be in inode order, so check the last hit first. */
+        if (hit != NULL && hit->offset == off) { continue; }
+
+        spin_lock(&icache_lock);
+        cached = icache_find(inst->adid, entry->inode) != NULL;
+        spin_unlock(&icache_lock);
+
+        if (cached) { continue; }
+
+        hit = NULL;
+        array_traverse(blocks, it) {
+            if (it->offset == off) {
+                hit = it;
+                break;
+            }
+        }
+
+        if (hit == NULL) {
+            new.offset = off;
+            new.data   = kmalloc(inst->sb.block_size);
+            new.rq     = blk_read_async(inst->adid, off, new.data, inst->sb.block_size);
+            hit        = array_push(blocks, new);
+        }
+    }
+
+    array_traverse(blocks, it) {
+        blk_wait(inst->adid, it->rq);
+        icache_fill(inst, it->offset, it->data, 0);
+        kfree(it->data);
+    }
+
+    array_free(blocks);
+}
+
+/*
+ * The inode and zone bitmaps are loaded once at mount and searched in memory
+ * a 64-bit word at a time, starting from the word where the last allocation
+ * succeeded. Changed bitmap blocks are only marked dirty; sync_bitmaps()
+ * writes them back once per operation rather than once per allocation.
+ */
+
+static u64 bitmap_find_and_set(u64 *map, u64 n_bits, u64 *hint) {
+    u64 n_words;
+    u64 i;
+    u64 w;
+    u64 free;
+
+    n_words = (n_bits + 63) / 64;
+
+    for (i = 0; i < n_words; i += 1) {
+        w    = (*hint + i) % n_words;
+        free = ~map[w];
+
+        /* Bits past the end of the map aren't real objects. */
+        if (w == n_words - 1 && n_bits % 64) {
+            free &= (1ULL << (n_bits % 64)) - 1;
+        }
+
+        if (free) {
+            map[w] |= free & -free;
+            *hint    = w;
+            return w * 64 + ctz64(free);
+        }
+    }
+
+    return (u64)-1;
+}
+
+static void load_bitmaps(Instance *inst) {
+    u64          imap_len;
+    u64          zmap_len;
+    Blk_Request *irq;
+    Blk_Request *zrq;
+
+    imap_len = inst->sb.imap_blocks * inst->sb.block_size;
+    zmap_len = inst->sb.zmap_blocks * inst->sb.block_size;
+
+    inst->imap       = kmalloc(imap_len);
+    inst->zmap       = kmalloc(zmap_len);
+    inst->imap_dirty = kmalloc(inst->sb.imap_blocks);
+    inst->zmap_dirty = kmalloc(inst->sb.zmap_blocks);
+    inst->ihint      = 0;
+    inst->zhint      = 0;
+
+    memset(inst->imap_dirty, 0, inst->sb.imap_blocks);
+    memset(inst->zmap_dirty, 0, inst->sb.zmap_blocks);
+
+    irq = blk_read_async(inst->adid, IMAP_OFFSET(inst->sb), (void*)inst->imap, imap_len);
+    zrq = blk_read_async(inst->adid, ZMAP_OFFSET(inst->sb), (void*)inst->zmap, zmap_len);
+
+    blk_wait(inst->adid, irq);
+    blk_wait(inst->adid, zrq);
+}
+
+static void sync_bitmaps(Instance *inst) {
+    array_t        pending;
+    Blk_Request   *rq;
+    Blk_Request  **rit;
+    u32            b;
+
+    pending = array_make(Blk_Request*);
+
+    spin_lock(&inst->alloc_lock);
+
+    for (b = 0; b < inst->sb.imap_blocks; b += 1) {
+        if (!inst->imap_dirty[b]) { continue; }
+
+        inst->imap_dirty[b] = 0;
+        rq = blk_write_async(inst->adid,
+                             IMAP_OFFSET(inst->sb) + b * inst->sb.block_size,
+                             (u8*)inst->imap + b * inst->sb.block_size,
+                             inst->sb.block_size);
+        array_push(pending, rq);
+    }
+
+    for (b = 0; b < inst->sb.zmap_blocks; b += 1) {
+        if (!inst->zmap_dirty[b]) { continue; }
+
+        inst->zmap_dirty[b] = 0;
+        rq = blk_write_async(inst->adid,
+                             ZMAP_OFFSET(inst->sb) + b * inst->sb.block_size,
+                             (u8*)inst->zmap + b * inst->sb.block_size,
+                             inst->sb.block_size);
+        array_push(pending, rq);
+    }
+
+    spin_unlock(&inst->alloc_lock);
+
+    array_traverse(pending, rit) {
+        blk_wait(inst->adid, *rit);
+    }
+
+    array_free(pending);
+}
+
+/* Bit n of the inode map is inode n. Bit 0 is reserved and always set. */
+static s64 claim_inode(Instance *inst) {
+    u64 bit;
+
+    spin_lock(&inst->alloc_lock);
+
+    bit = bitmap_find_and_set(inst->imap, (u64)inst->sb.num_inodes + 1, &inst->ihint);
+
+    if (bit != (u64)-1) {
+        inst->imap_dirty[bit / 8 / inst->sb.block_size] = 1;
+    }
+
+    spin_unlock(&inst->alloc_lock);
+
+    return bit == (u64)-1 ? -1 : (s64)bit;
+}
+
+/* Gives back an inode from claim_inode() that never got used. */
+static void release_inode(Instance *inst, u32 inum) {
+    spin_lock(&inst->alloc_lock);
+
+    inst->imap[inum / 64]                            &= ~(1ULL << (inum % 64));
+    inst->imap_dirty[inum / 8 / inst->sb.block_size]  = 1;
+
+    spin_unlock(&inst->alloc_lock);
+}
+
+/*
+ * Bit n of the zone map is zone first_data_zone + n - 1. Bit 0 is reserved.
+ * Claims the first free zone after the hint and up to want - 1 free zones
+ * directly following it, so that callers with many blocks to place get them
+ * physically contiguous. Returns the first zone and the run length in *got,
+ * or 0 (never a valid data zone) when the disk is full.
+ */
+static u32 claim_zone_run(Instance *inst, u32 want, u32 *got) {
+    u64 n_bits;
+    u64 bit;
+    u64 n;
+    u64 i;
+
+    spin_lock(&inst->alloc_lock);
+
+    n_bits = (u64)inst->sb.num_zones - inst->sb.first_data_zone + 1;
+    bit    = bitmap_find_and_set(inst->zmap, n_bits, &inst->zhint);
+
+    if (bit == (u64)-1) {
+        spin_unlock(&inst->alloc_lock);
+        kprint("minix3: out of zones\n");
+        *got = 0;
+        return 0;
+    }
+
+    n = 1;
+    while (n < want
+    &&     bit + n < n_bits
+    &&     !(inst->zmap[(bit + n) / 64] & (1ULL << ((bit + n) % 64)))) {
+
+        inst->zmap[(bit + n) / 64] |= 1ULL << ((bit + n) % 64);
+        n += 1;
+    }
 
-static File *mount_file(Instance *inst, Inode *inode, Dir_Entry *entry, File *mount_point) {
+    for (i = bit / 8 / inst->sb.block_size; i <= (bit + n - 1) / 8 / inst->sb.block_size; i += 1) {
+        inst->zmap_dirty[i] = 1;
+    }
+
+    spin_unlock(&inst->alloc_lock);
+
+    *got = n;
+    return inst->sb.first_data_zone + bit - 1;
+}
+
+static u32 claim_zone(Instance *inst) {
+    u32 got;
+
+    return claim_zone_run(inst, 1, &got);
+}
+
+/*
+ * File block mapping. Indirect blocks touched while mapping are kept in an
+ * array of Ind_Block for the duration of one operation, so that walking a run
+ * of blocks reads each indirect block once. Changes are written back by
+ * ind_release().
+ */
+
+typedef struct {
+    u32  zone;
+    u32 *data;
+    u32  dirty;
+} Ind_Block;
+
+static Ind_Block *ind_get(Instance *inst, array_t *ind, u32 zone, u32 fresh) {
+    Ind_Block **it;
+    Ind_Block  *ib;
+
+    array_traverse(*ind, it) {
+        if ((*it)->zone == zone) { return *it; }
+    }
+
+    ib        = kmalloc(sizeof(*ib));
+    ib->zone  = zone;
+    ib->data  = kmalloc(inst->sb.block_size);
+    ib->dirty = fresh;
+
+    if (fresh) {
+        memset(ib->data, 0, inst->sb.block_size);
+    } else {
+        blk_read(inst->adid, (u64)zone * inst->sb.block_size, (void*)ib->data, inst->sb.block_size);
+    }
+
+    array_push(*ind, ib);
+
+    return ib;
+}
+
+static void ind_release(Instance *inst, array_t *ind) {
+    array_t       pending;
+    Blk_Request  *rq;
+    Blk_Request **rit;
+    Ind_Block   **it;
+
+    pending = array_make(Blk_Request*);
+
+    array_traverse(*ind, it) {
+        if ((*it)->dirty) {
+            rq = blk_write_async(inst->adid, (u64)(*it)->zone * inst->sb.block_size, (void*)(*it)->data, inst->sb.block_size);
+            array_push(pending, rq);
+        }
+    }
+
+    array_traverse(pending, rit) {
+        blk_wait(inst->adid, *rit);
+    }
+
+    array_traverse(*ind, it) {
+        kfree((*it)->data);
+        kfree(*it);
+    }
+
+    array_free(pending);
+    array_free(*ind);
+}
+
+/*
+ * Returns the zone holding file block fblock, or 0 if it's a hole. If it's a
+ * hole and zone is nonzero, zone is installed there first, along with any
+ * indirect blocks needed on the way down.
+ */
+static u32 bmap(Instance *inst, Cached_Inode *ci, array_t *ind, u64 fblock, u32 zone) {
+    u64        per;
+    u32        depth;
+    u32       *slot;
+    u64        idx[3];
+    u32        i;
+    Ind_Block *parent;
+    u32        fresh;
+
+    per = inst->sb.block_size / 4;
+
+    if (fblock < 7) {
+        slot  = &ci->inode.zones[fblock];
+        depth = 0;
+    } else if ((fblock -= 7) < per) {
+        slot  = &ci->inode.zones[7];
+        depth = 1;
+    } else if ((fblock -= per) < per * per) {
+        slot  = &ci->inode.zones[8];
+        depth = 2;
+    } else if ((fblock -= per * per) < per * per * per) {
+        slot  = &ci->inode.zones[9];
+        depth = 3;
+    } else {
+        return 0;
+    }
+
+    for (i = depth; i > 0; i -= 1) {
+        idx[i - 1]  = fblock % per;
+        fblock     /= per;
+    }
+
+    parent = NULL;
+
+    for (i = 0; i < depth; i += 1) {
+        fresh = 0;
+
+        if (*slot == 0) {
+            if (zone == 0 || (*slot = claim_zone(inst)) == 0) { return 0; }
+
+            if (parent == NULL) { imark_dirty(ci);      }
+            else                { parent->dirty = 1;    }
+
+            fresh = 1;
+        }
+
+        parent = ind_get(inst, ind, *slot, fresh);
+        slot   = &parent->data[idx[i]];
+    }
+
+    if (*slot == 0 && zone != 0) {
+        *slot = zone;
+
+        if (parent == NULL) { imark_dirty(ci);   }
+        else                { parent->dirty = 1; }
+    }
+
+    return *slot;
+}
+
+/*
+ * Directories are read lazily: mount() only fills in the root and every
+ * subdirectory is left unpopulated until the VFS asks for its children.
+ */
+
+static File *mount_file(Instance *inst, Inode *inode, Dir_Entry *entry, File *dir) {
     File *f;
 
     f = vfs_new_file(entry->name,
@@ -123,47 +723,61 @@ static File *mount_file(Instance *inst, Inode *inode, Dir_Entry *entry, File *mo
     f->inode = entry->inode;
     f->fs    = FS_MINIX3;
 
-    vfs_add_dir_entry(mount_point, f);
+    /* "." and ".." are resolved by the VFS itself, so there's nothing to load. */
+    if (f->kind == FILE_DIRECTORY
+    &&  strcmp(entry->name, ".")  != 0
+    &&  strcmp(entry->name, "..") != 0) {
+        f->populated = 0;
+    }
+
+    vfs_add_dir_entry(dir, f);
 
     return f;
 }
 
-static void mount_dir_entries(Instance *inst, Inode *inode, File *mount_point) {
+static void collect_block_entries(Instance *inst, u32 zone, void *block, u32 *num_entries, array_t *entries) {
+    u32        j;
+    Dir_Entry *entry;
+
+    blk_read(inst->adid,
+             zone * inst->sb.block_size,
+             block,
+             inst->sb.block_size);
+
+    for (j = 0; j < inst->sb.block_size / sizeof(Dir_Entry) && *num_entries; j += 1) {
+        entry = block + (j * sizeof(Dir_Entry));
+
+        /* Inode 0 marks an unused slot. */
+        if (entry->inode != 0) {
+            array_push(*entries, *entry);
+        }
+
+        *num_entries -= 1;
+    }
+}
+
+static array_t collect_dir_entries(Instance *inst, Inode *inode) {
+    array_t    entries;
     u32        num_entries;
     void      *block;
     u32        i;
-    Dir_Entry *entry;
-    u32        j;
-    Inode      entry_inode;
     u32       *iblock;
-    u32        k;
+    u32        j;
     u32       *diblock;
-    u32        l;
+    u32        k;
     u32       *tiblock;
 
+    entries     = array_make(Dir_Entry);
     num_entries = inode->size / sizeof(Dir_Entry);
 
-    if (num_entries == 0) { return; }
+    if (num_entries == 0) { return entries; }
 
     block = kmalloc(inst->sb.block_size);
 
     for (i = 0; i < 7 && num_entries; i += 1) {
         if (inode->zones[i] == 0) { continue; }
 
-        blk_read(inst->adid,
-                 inode->zones[i] * inst->sb.block_size,
-                 block,
-                 inst->sb.block_size);
-
-        for (j = 0; j < inst->sb.block_size / sizeof(Dir_Entry) && num_entries; j += 1) {
-            entry = block + (j * sizeof(Dir_Entry));
-
-            blk_read(inst->adid, OFFSET(inst->sb, entry->inode), (void*)&entry_inode, sizeof(entry_inode));
-            mount_inode(inst, &entry_inode, entry, mount_point);
-
-
-            num_entries -= 1;
-        }
+        collect_block_entries(inst, inode->zones[i], block, &num_entries, &entries);
     }
 
     if (num_entries > 0) {
@@ -174,19 +788,7 @@ static void mount_dir_entries(Instance *inst, Inode *inode, File *mount_point) {
         for (i = 0; i < inst->sb.block_size / 4 && num_entries; i += 1) {
             if (iblock[i] == 0) { continue; }
 
-            blk_read(inst->adid,
-                     iblock[i] * inst->sb.block_size,
-                     block,
-                     inst->sb.block_size);
-
-            for (j = 0; j < inst->sb.block_size / sizeof(Dir_Entry) && num_entries; j += 1) {
-                entry = block + (j * sizeof(Dir_Entry));
-
-                blk_read(inst->adid, OFFSET(inst->sb, entry->inode), (void*)&entry_inode, sizeof(entry_inode));
-                mount_inode(inst, &entry_inode, entry, mount_point);
-
-                num_entries -= 1;
-            }
+            collect_block_entries(inst, iblock[i], block, &num_entries, &entries);
         }
 
         kfree(iblock);
@@ -206,19 +808,7 @@ static void mount_dir_entries(Instance *inst, Inode *inode, File *mount_point) {
             for (j = 0; j < inst->sb.block_size / 4 && num_entries; j += 1) {
                 if (diblock[j] == 0) { continue; }
 
-                blk_read(inst->adid,
-                         diblock[j] * inst->sb.block_size,
-                         block,
-                         inst->sb.block_size);
-
-                for (k = 0; k < inst->sb.block_size / sizeof(Dir_Entry) && num_entries; k += 1) {
-                    entry = block + (k * sizeof(Dir_Entry));
-
-                    blk_read(inst->adid, OFFSET(inst->sb, entry->inode), (void*)&entry_inode, sizeof(entry_inode));
-                    mount_inode(inst, &entry_inode, entry, mount_point);
-
-                    num_entries -= 1;
-                }
+                collect_block_entries(inst, diblock[j], block, &num_entries, &entries);
             }
         }
 
@@ -246,14 +836,7 @@ static void mount_dir_entries(Instance *inst, Inode *inode, File *mount_point) {
                 for (k = 0; k < inst->sb.block_size / 4 && num_entries; k += 1) {
                     if (tiblock[k] == 0) { continue; }
 
-                    for (l = 0; l < inst->sb.block_size / sizeof(Dir_Entry) && num_entries; l += 1) {
-                        entry = block + (l * sizeof(Dir_Entry));
-
-                        blk_read(inst->adid, OFFSET(inst->sb, entry->inode), (void*)&entry_inode, sizeof(entry_inode));
-                        mount_inode(inst, &entry_inode, entry, mount_point);
-
-                        num_entries -= 1;
-                    }
+                    collect_block_entries(inst, tiblock[k], block, &num_entries, &entries);
                 }
             }
         }
@@ -264,413 +847,563 @@ static void mount_dir_entries(Instance *inst, Inode *inode, File *mount_point) {
     }
 
     kfree(block);
+
+    return entries;
 }
 
-static void mount_inode(Instance *inst, Inode *inode, Dir_Entry *entry, File *mount_point) {
-    File *f;
+/* Create Files for every entry of the directory described by inode. */
+static void mount_dir_entries(Instance *inst, Inode *inode, File *dir) {
+    array_t       entries;
+    Dir_Entry    *entry;
+    Cached_Inode *ci;
 
-    f = mount_file(inst, inode, entry, mount_point);
+    entries = collect_dir_entries(inst, inode);
 
-    if (inode->mode & S_IFDIR
-    &&  strcmp(entry->name, ".")  != 0
-    &&  strcmp(entry->name, "..") != 0) {
-        mount_dir_entries(inst, inode, f);
+    icache_prefetch(inst, entries);
+
+    array_traverse(entries, entry) {
+        if ((ci = iget(inst, entry->inode)) == NULL) { continue; }
+
+        mount_file(inst, &ci->inode, entry, dir);
+        iput(inst, ci);
     }
+
+    array_free(entries);
+}
+
+static s64 populate(File *dir) {
+    Instance     *inst;
+    Cached_Inode *ci;
+
+    if ((inst = get_instance(dir->adid)) == NULL) { return -1; }
+
+    if ((ci = iget(inst, dir->inode)) == NULL) { return -1; }
+
+    mount_dir_entries(inst, &ci->inode, dir);
+    iput(inst, ci);
+
+    return 0;
 }
 
 static s64 mount(u32 adid, File *mount_point) {
-    Instance *inst;
-    u32       inum;
-    Inode     inode;
+    Instance     *inst;
+    Cached_Inode *ci;
 
     if ((inst = get_instance(adid)) == NULL) { return -1; }
 
-    inum = 1;
-    blk_read(inst->adid, OFFSET(inst->sb, inum), (void*)&inode, sizeof(inode));
+    if ((ci = iget(inst, 1)) == NULL) { return -1; }
 
-    if (!(inode.mode & S_IFDIR)) {
+    if (!(ci->inode.mode & S_IFDIR)) {
         kprint("root inode is not a directory\n");
+        iput(inst, ci);
         return -1;
     }
 
-    mount_dir_entries(inst, &inode, mount_point);
-
-    return 0;
-}
-
-static s64 claim_inode(Instance *inst) {
-    u8  *block;
-    u32  inum;
-    u32  b;
-    u32  i;
-    u32  j;
+    load_bitmaps(inst);
 
-    block = kmalloc(inst->sb.block_size);
+    mount_dir_entries(inst, &ci->inode, mount_point);
 
-    inum = 1;
-    for (b = 0; b < inst->sb.imap_blocks; b += 1) {
-        blk_read(inst->adid,
-                 1024ULL + inst->sb.block_size + (b * inst->sb.block_size),
-                 block,
-                 inst->sb.block_size);
-
-        for (i = 0; i < inst->sb.block_size; i += 1) {
-            for (j = 0; j < 8; j += 1) {
-                if (!(block[i] & (1 << j))) {
-                    block[i] |= (1 << j);
-                    blk_write(inst->adid,
-                              1024ULL + inst->sb.block_size + (b * inst->sb.block_size),
-                              block,
-                              inst->sb.block_size);
-                    kfree(block);
-                    return inum;
-                }
-                inum += 1;
-            }
-        }
-    }
+    iput(inst, ci);
 
-    kfree(block);
-    return -1;
+    return 0;
 }
 
-static u32 claim_zone(Instance *inst) {
-    u8  *block;
-    u32  znum;
-    u32  b;
-    u32  i;
-    u32  j;
+/*
+ * Freshly claimed zones still hold whatever the last owner left there. Rather
+ * than writing zero buffers, we collect runs of consecutive zones and have the
+ * device zero each run with a single write-zeroes request.
+ */
+typedef struct {
+    u32 start;
+    u32 len;
+} Zone_Run;
 
-    block = kmalloc(inst->sb.block_size);
+static void zero_run_flush(Instance *inst, Zone_Run *run) {
+    if (run->len == 0) { return; }
 
-    znum = 1;
-    for (b = 0; b < inst->sb.zmap_blocks; b += 1) {
-        blk_read(inst->adid,
-                 1024ULL + inst->sb.block_size + (inst->sb.imap_blocks * inst->sb.block_size) + (b * inst->sb.block_size),
-                 block,
-                 inst->sb.block_size);
-
-        for (i = 0; i < inst->sb.block_size; i += 1) {
-            for (j = 0; j < 8; j += 1) {
-                if (!(block[i] & (1 << j))) {
-                    block[i] |= (1 << j);
-                    blk_write(inst->adid,
-                              1024ULL + inst->sb.block_size + (b * inst->sb.block_size),
-                              block,
-                              inst->sb.block_size);
-                    kfree(block);
-                    return znum;
-                }
-                znum += 1;
-            }
-        }
-    }
+    blk_write_zeroes(inst->adid,
+                     (u64)run->start * inst->sb.block_size,
+                     (u64)run->len * inst->sb.block_size);
 
-    kfree(block);
-    return -1;
+    run->len = 0;
 }
 
-static void grow_to_fit(Instance *inst, u32 inum, Inode *inode, u32 new_size) {
-    u32  new_blocks;
-    u32  changed;
-    u32  i;
-    u32 *iblock;
-    u32  ichanged;
-
-    if (inode->size >= new_size) { return; }
+static void zero_run_add(Instance *inst, Zone_Run *run, u32 zone) {
+    if (run->len > 0 && zone == run->start + run->len) {
+        run->len += 1;
+        return;
+    }
 
-    new_blocks = (new_size - inode->size) / inst->sb.block_size;
+    zero_run_flush(inst, run);
 
-    changed = 0;
+    run->start = zone;
+    run->len   = 1;
+}
 
-    for (i = 0; i < 7 && new_blocks; i += 1) {
-        if (inode->zones[i] == 0) {
-            inode->zones[i] = claim_zone(inst);
-            new_blocks -= 1;
-            changed = 1;
-        }
+static void grow_to_fit(Instance *inst, Cached_Inode *ci, u32 new_size) {
+    u64       old_blocks;
+    u64       new_blocks;
+    u64       fblock;
+    u32       need;
+    u32       zone;
+    u32       run_len;
+    array_t   ind;
+    Zone_Run  run;
+
+    if (ci->inode.size >= new_size) { return; }
+
+    old_blocks = (ci->inode.size + inst->sb.block_size - 1) / inst->sb.block_size;
+    new_blocks = (new_size       + inst->sb.block_size - 1) / inst->sb.block_size;
+
+    ind     = array_make(Ind_Block*);
+    run.len = 0;
+    need    = 0;
+    run_len = 0;
+    zone    = 0;
+
+    for (fblock = old_blocks; fblock < new_blocks; fblock += 1) {
+        if (bmap(inst, ci, &ind, fblock, 0) == 0) { need += 1; }
     }
 
-    if (changed) {
-        blk_write(inst->adid, OFFSET(inst->sb, inum), (void*)inode, sizeof(*inode));
-    }
+    for (fblock = old_blocks; fblock < new_blocks; fblock += 1) {
+        if (bmap(inst, ci, &ind, fblock, 0) != 0) { continue; }
 
-    if (new_blocks > 0) {
-        iblock = kmalloc(inst->sb.block_size);
-        blk_read(inst->adid, inode->zones[7] * inst->sb.block_size, (void*)iblock, inst->sb.block_size);
+        if (run_len == 0 && (zone = claim_zone_run(inst, need, &run_len)) == 0) { break; }
 
-        ichanged = 0;
+        if (bmap(inst, ci, &ind, fblock, zone) == 0) { break; }
 
-        for (i = 0; i < inst->sb.block_size / 4 && new_blocks; i += 1) {
-            if (iblock[i] == 0) {
-                iblock[i] = claim_inode(inst);
-                new_blocks -= 1;
-                ichanged    = 1;
-            }
-        }
+        zero_run_add(inst, &run, zone);
 
-        if (ichanged) {
-            blk_write(inst->adid, inode->zones[8] * inst->sb.block_size, (void*)iblock, inst->sb.block_size);
-        }
-        kfree(iblock);
+        zone    += 1;
+        run_len -= 1;
+        need    -= 1;
     }
-    /* @todo doubly and triply indirect */
 
+    zero_run_flush(inst, &run);
+    ind_release(inst, &ind);
 }
 
 static s64 create(File *dir, const char *name, u32 kind) {
-    Instance  *inst;
-    Inode      inode;
-    u32        inum;
-    void      *block;
-    u32        num_entries;
-    u32        i;
-    Dir_Entry *entry;
-    File      *new;
+    Instance     *inst;
+    Cached_Inode *dci;
+    Cached_Inode *ci;
+    u32           inum;
+    void         *block;
+    u32           zone;
+    array_t       ind;
+    Dir_Entry    *entry;
+    File         *new;
 
     if ((inst = get_instance(dir->adid)) == NULL) { return -1; }
 
-    blk_read(inst->adid,
-             OFFSET(inst->sb, dir->inode),
-             (void*)&inode,
-             sizeof(inode));
-
-    grow_to_fit(inst, dir->inode, &inode, inode.size + sizeof(Dir_Entry));
+    if ((dci = iget(inst, dir->inode)) == NULL) { return -1; }
 
-    inum = claim_inode(inst);
-
-    blk_read(inst->adid,
-             OFFSET(inst->sb, dir->inode),
-             (void*)&inode,
-             sizeof(inode));
-
-    num_entries = inode.size / sizeof(Dir_Entry);
-
-    block = kmalloc(inst->sb.block_size);
+    spin_lock(&dci->wlock);
 
-    for (i = 0; i < 7; i += 1) {
-        if (inode.zones[i] == 0) { continue; }
+    if ((inum = claim_inode(inst)) == (u32)-1) {
+        kprint("minix3: out of inodes\n");
+        spin_unlock(&dci->wlock);
+        iput(inst, dci);
+        return -1;
+    }
 
-        blk_read(inst->adid,
-                 inode.zones[i] * inst->sb.block_size,
-                 block,
-                 inst->sb.block_size);
+    /* Got before the directory entry is written so there's nothing to undo on disk if it fails. */
+    if ((ci = iget(inst, inum)) == NULL) {
+        release_inode(inst, inum);
+        spin_unlock(&dci->wlock);
+        iput(inst, dci);
+        return -1;
+    }
 
-        if (num_entries > inst->sb.block_size / sizeof(Dir_Entry)) {
-            num_entries -= inst->sb.block_size / sizeof(Dir_Entry);
-        } else {
-            entry = block + num_entries * sizeof(Dir_Entry);
+    grow_to_fit(inst, dci, dci->inode.size + sizeof(Dir_Entry));
 
-            entry->inode = inum;
-            strcpy(entry->name, name);
+    ind  = array_make(Ind_Block*);
+    zone = bmap(inst, dci, &ind, dci->inode.size / inst->sb.block_size, 0);
+    ind_release(inst, &ind);
 
-            blk_write(inst->adid,
-                    inode.zones[i] * inst->sb.block_size,
-                    block,
-                    inst->sb.block_size);
-            break;
-        }
+    if (zone == 0) {
+        /* Nothing refers to the inode yet, so it goes back rather than being persisted as used. */
+        release_inode(inst, inum);
+        spin_unlock(&dci->wlock);
+        iput(inst, ci);
+        iput(inst, dci);
+        sync_bitmaps(inst);
+        return -1;
     }
 
-    inode.size += sizeof(Dir_Entry);
+    block = kmalloc(inst->sb.block_size);
+
+    blk_read(inst->adid, (u64)zone * inst->sb.block_size, block, inst->sb.block_size);
 
-    blk_write(inst->adid,
-              OFFSET(inst->sb, dir->inode),
-              (void*)&inode,
-              sizeof(inode));
+    entry = block + (dci->inode.size % inst->sb.block_size);
 
+    entry->inode = inum;
+    strcpy(entry->name, name);
 
-    /* @todo indirection */
+    blk_write(inst->adid, (u64)zone * inst->sb.block_size, block, inst->sb.block_size);
 
     kfree(block);
 
+    dci->inode.size += sizeof(Dir_Entry);
+    imark_dirty(dci);
 
+    spin_unlock(&dci->wlock);
+    iput(inst, dci);
 
-    memset(&inode, 0, sizeof(inode));
+    memset(&ci->inode, 0, sizeof(ci->inode));
 
     if (kind == FILE_REGULAR) {
-        inode.mode |= S_IFREG;
+        ci->inode.mode |= S_IFREG;
     } else if (kind == FILE_DIRECTORY) {
-        inode.mode |= S_IFDIR;
+        ci->inode.mode |= S_IFDIR;
     }
 
-    inode.nlinks = 1;
+    ci->inode.nlinks = 1;
 
-    blk_write(inst->adid, OFFSET(inst->sb, inum), (void*)&inode, sizeof(inode));
+    imark_dirty(ci);
+    iput(inst, ci);
 
-    new = vfs_new_file(name, kind, inst->adid);
+    sync_bitmaps(inst);
+
+    new        = vfs_new_file(name, kind, inst->adid);
+    new->inode = inum;
+    new->fs    = FS_MINIX3;
     vfs_add_dir_entry(dir, new);
 
     return 0;
 }
 
-static s64 read(File *file, u8 *dst, u64 offset, u64 n_bytes) {
-    Instance *inst;
-    Inode     inode;
-    void     *block;
-    u64       boff;
-    u32       i;
-    u64       start;
-    u64       n;
-    u32      *iblock;
-    u32      *diblock;
-    u32       j;
-    u32      *tiblock;
-    u32       k;
+/*
+ * Writes only land in whole-block buffers hanging off the cached inode; no
+ * zones are claimed for them yet. flush_inode() then claims zones for all of
+ * the unmapped buffered blocks at once, in runs that are as contiguous as the
+ * zone map allows, so a file written front to back ends up sequential on
+ * disk. Data goes out before the indirect blocks and the inode that point at
+ * it. While anything is buffered, the buffer holds a reference to the inode
+ * so it can't be evicted.
+ */
 
-    inst = get_instance(file->adid);
+#define WBUF_MAX_BLOCKS (256)
 
-    blk_read(inst->adid,
-             OFFSET(inst->sb, file->inode),
-             (void*)&inode,
-             sizeof(inode));
+typedef struct {
+    u64  fblock;
+    u8  *data;
+} Buffered_Block;
+
+/* Index of the first buffered block at or after fblock. */
+static u32 wbuf_search(Cached_Inode *ci, u64 fblock) {
+    u32             lo;
+    u32             hi;
+    u32             mid;
+    Buffered_Block *bb;
+
+    lo = 0;
+    hi = array_len(ci->wbuf);
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        bb  = array_item(ci->wbuf, mid);
+
+        if (bb->fblock < fblock) { lo = mid + 1; }
+        else                     { hi = mid;     }
+    }
 
-    block = kmalloc(inst->sb.block_size);
-    boff  = 0;
+    return lo;
+}
 
-    for (i = 0; i < 7 && n_bytes; i += 1) {
-        if (inode.zones[i] == 0) { continue; }
+/* Must be called with ci->wlock held. */
+static s64 flush_inode(Instance *inst, Cached_Inode *ci) {
+    array_t         ind;
+    array_t         pending;
+    Buffered_Block *bb;
+    Blk_Request    *rq;
+    Blk_Request   **rit;
+    u32             need;
+    u32             zone;
+    u32             run_zone;
+    u32             run_len;
+    s64             status;
+
+    if (ci->wbuf.elem_size == 0 || array_len(ci->wbuf) == 0) { return 0; }
+
+    ind      = array_make(Ind_Block*);
+    pending  = array_make(Blk_Request*);
+    need     = 0;
+    run_zone = 0;
+    run_len  = 0;
+    status   = 0;
+
+    array_traverse(ci->wbuf, bb) {
+        if (bmap(inst, ci, &ind, bb->fblock, 0) == 0) { need += 1; }
+    }
 
-        if (boff + inst->sb.block_size >= offset) {
-            start = offset & (inst->sb.block_size - 1);
-            n     = start == 0
-                        ? MIN(inst->sb.block_size, n_bytes)
-                        : inst->sb.block_size - start;
+    array_traverse(ci->wbuf, bb) {
+        if ((zone = bmap(inst, ci, &ind, bb->fblock, 0)) == 0) {
+            if (run_len == 0 && (run_zone = claim_zone_run(inst, need, &run_len)) == 0) {
+                status = -1;
+                break;
+            }
 
-            blk_read(inst->adid, inode.zones[i] * inst->sb.block_size + start, dst, n);
+            if ((zone = bmap(inst, ci, &ind, bb->fblock, run_zone)) == 0) {
+                status = -1;
+                break;
+            }
 
-            offset  += n;
-            dst     += n;
-            n_bytes -= n;
+            run_zone += 1;
+            run_len  -= 1;
+            need     -= 1;
         }
 
-        boff += inst->sb.block_size;
+        rq = blk_write_async(inst->adid, (u64)zone * inst->sb.block_size, bb->data, inst->sb.block_size);
+        array_push(pending, rq);
     }
 
-    if (n_bytes > 0) {
-        iblock = kmalloc(inst->sb.block_size);
+    array_traverse(pending, rit) {
+        if (blk_wait(inst->adid, *rit) != 0) { status = -1; }
+    }
 
-        blk_read(inst->adid, inode.zones[7] * inst->sb.block_size, (void*)iblock, inst->sb.block_size);
+    ind_release(inst, &ind);
+    sync_bitmaps(inst);
+    array_free(pending);
 
-        for (i = 0; i < inst->sb.block_size / 4 && n_bytes; i += 1) {
-            if (iblock[i] == 0) { continue; }
+    /* Keep the data buffered and the old size if any of it didn't make it to disk. */
+    if (status != 0) { return status; }
+
+    if (ci->pending_size > ci->inode.size) {
+        ci->inode.size = ci->pending_size;
+        imark_dirty(ci);
+    }
 
-            if (boff + inst->sb.block_size >= offset) {
-                start = offset & (inst->sb.block_size - 1);
-                n     = start == 0
-                            ? MIN(inst->sb.block_size, n_bytes)
-                            : inst->sb.block_size - start;
+    array_traverse(ci->wbuf, bb) {
+        kfree(bb->data);
+    }
+    array_clear(ci->wbuf);
 
-                blk_read(inst->adid, iblock[i] * inst->sb.block_size + start, dst, n);
+    /* Drop the buffer's reference. The caller still holds one, so this doesn't write the inode yet. */
+    iput(inst, ci);
 
-                offset  += n;
-                dst     += n;
-                n_bytes -= n;
-            }
+    return 0;
+}
+
+static s64 read(File *file, u8 *dst, u64 offset, u64 n_bytes) {
+    Instance      *inst;
+    Cached_Inode  *ci;
+    array_t        ind;
+    array_t        pending;
+    Blk_Request   *rq;
+    Blk_Request  **rit;
+    u64            start;
+    u64            n;
+    u32            zone;
+    s64            n_read;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+    if ((ci = iget(inst, file->inode)) == NULL)    { return -1; }
+
+    spin_lock(&ci->wlock);
+
+    flush_inode(inst, ci);
+
+    if (offset >= ci->inode.size) {
+        n_bytes = 0;
+    } else {
+        n_bytes = MIN(n_bytes, ci->inode.size - offset);
+    }
 
-            boff += inst->sb.block_size;
+    n_read  = n_bytes;
+    ind     = array_make(Ind_Block*);
+    pending = array_make(Blk_Request*);
+
+    /*
+     * Data reads are only queued, so that runs of adjacent zones reach the
+     * device as one request. Holes read as zeroes.
+     */
+    while (n_bytes > 0) {
+        start = offset % inst->sb.block_size;
+        n     = MIN(inst->sb.block_size - start, n_bytes);
+        zone  = bmap(inst, ci, &ind, offset / inst->sb.block_size, 0);
+
+        if (zone == 0) {
+            memset(dst, 0, n);
+        } else {
+            rq = blk_read_async(inst->adid, (u64)zone * inst->sb.block_size + start, dst, n);
+            array_push(pending, rq);
         }
 
-        kfree(iblock);
+        offset  += n;
+        dst     += n;
+        n_bytes -= n;
     }
 
-    if (n_bytes > 0) {
-        iblock  = kmalloc(inst->sb.block_size);
-        diblock = kmalloc(inst->sb.block_size);
+    array_traverse(pending, rit) {
+        if (blk_wait(inst->adid, *rit) != 0) { n_read = -1; }
+    }
 
-        blk_read(inst->adid, inode.zones[8] * inst->sb.block_size, (void*)iblock, inst->sb.block_size);
+    array_free(pending);
+    ind_release(inst, &ind);
 
-        for (i = 0; i < inst->sb.block_size / 4 && n_bytes; i += 1) {
-            if (iblock[i] == 0) { continue; }
+    spin_unlock(&ci->wlock);
+    iput(inst, ci);
 
-            blk_read(inst->adid, iblock[i] * inst->sb.block_size, (void*)diblock, inst->sb.block_size);
+    return n_read;
+}
 
-            for (j = 0; j < inst->sb.block_size / 4 && n_bytes; j += 1) {
-                if (diblock[j] == 0) { continue; }
+static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes) {
+    Instance       *inst;
+    Cached_Inode   *ci;
+    u64             written;
+    u64             fblock;
+    u64             start;
+    u64             n;
+    u32             idx;
+    Buffered_Block *bb;
+    Buffered_Block  new;
+    array_t         ind;
+    u32             zone;
+    s64             status;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+    if ((ci = iget(inst, file->inode)) == NULL)    { return -1; }
+
+    /* Minix3 sizes are 32 bits. */
+    if (offset + n_bytes > 0xFFFFFFFFULL) {
+        iput(inst, ci);
+        return -1;
+    }
 
-                if (boff + inst->sb.block_size >= offset) {
-                    start = offset & (inst->sb.block_size - 1);
-                    n     = start == 0
-                                ? MIN(inst->sb.block_size, n_bytes)
-                                : inst->sb.block_size - start;
+    spin_lock(&ci->wlock);
 
-                    blk_read(inst->adid, diblock[j] * inst->sb.block_size + start, dst, n);
+    if (ci->wbuf.elem_size == 0) {
+        ci->wbuf = array_make(Buffered_Block);
+    }
 
-                    offset  += n;
-                    dst     += n;
-                    n_bytes -= n;
-                }
+    written = 0;
+    status  = 0;
+
+    while (n_bytes > 0) {
+        fblock = offset / inst->sb.block_size;
+        start  = offset % inst->sb.block_size;
+        n      = MIN(inst->sb.block_size - start, n_bytes);
+        idx    = wbuf_search(ci, fblock);
+        bb     = idx < array_len(ci->wbuf) ? array_item(ci->wbuf, idx) : NULL;
+
+        if (bb == NULL || bb->fblock != fblock) {
+            new.fblock = fblock;
+            new.data   = kmalloc(inst->sb.block_size);
+
+            /* A partially overwritten block keeps whatever it held before. */
+            zone = 0;
+            if ((start != 0 || n != inst->sb.block_size)
+            &&  fblock * inst->sb.block_size < ci->inode.size) {
+
+                ind  = array_make(Ind_Block*);
+                zone = bmap(inst, ci, &ind, fblock, 0);
+                ind_release(inst, &ind);
+            }
 
-                boff += inst->sb.block_size;
+            if (zone != 0) {
+                blk_read(inst->adid, (u64)zone * inst->sb.block_size, new.data, inst->sb.block_size);
+            } else {
+                memset(new.data, 0, inst->sb.block_size);
             }
+
+            if (array_len(ci->wbuf) == 0) {
+                spin_lock(&icache_lock);
+                ci->refs += 1;
+                spin_unlock(&icache_lock);
+            }
+
+            bb = array_insert(ci->wbuf, idx, new);
         }
 
-        kfree(diblock);
-        kfree(iblock);
+        memcpy(bb->data + start, src, n);
+
+        offset  += n;
+        src     += n;
+        n_bytes -= n;
+        written += n;
     }
 
-    if (n_bytes > 0) {
-        iblock  = kmalloc(inst->sb.block_size);
-        diblock = kmalloc(inst->sb.block_size);
-        tiblock = kmalloc(inst->sb.block_size);
+    if (offset > MAX(ci->inode.size, ci->pending_size)) {
+        ci->pending_size = offset;
+    }
 
-        blk_read(inst->adid, inode.zones[9] * inst->sb.block_size, (void*)iblock, inst->sb.block_size);
+    if (array_len(ci->wbuf) >= WBUF_MAX_BLOCKS) {
+        status = flush_inode(inst, ci);
+    }
 
-        for (i = 0; i < inst->sb.block_size / 4 && n_bytes; i += 1) {
-            if (iblock[i] == 0) { continue; }
+    spin_unlock(&ci->wlock);
+    iput(inst, ci);
 
-            blk_read(inst->adid, iblock[i] * inst->sb.block_size, (void*)diblock, inst->sb.block_size);
+    return status == 0 ? (s64)written : -1;
+}
 
-            for (j = 0; j < inst->sb.block_size / 4 && n_bytes; j += 1) {
-                if (diblock[j] == 0) { continue; }
+static s64 size(File *file) {
+    Instance     *inst;
+    Cached_Inode *ci;
+    s64           size;
 
-                blk_read(inst->adid, diblock[j] * inst->sb.block_size, (void*)tiblock, inst->sb.block_size);
+    inst = get_instance(file->adid);
 
-                for (k = 0; k < inst->sb.block_size / 4 && n_bytes; k += 1) {
-                    if (tiblock[k] == 0) { continue; }
+    ci   = iget(inst, file->inode);
+    size = MAX(ci->inode.size, ci->pending_size);
+    iput(inst, ci);
 
-                    if (boff + inst->sb.block_size >= offset) {
-                        start = offset & (inst->sb.block_size - 1);
-                        n     = start == 0
-                                    ? MIN(inst->sb.block_size, n_bytes)
-                                    : inst->sb.block_size - start;
+    return size;
+}
 
-                        blk_read(inst->adid, tiblock[k] * inst->sb.block_size + start, dst, n);
+static s64 sync(File *file) {
+    Instance     *inst;
+    Cached_Inode *ci;
+    s64           status;
 
-                        offset  += n;
-                        dst     += n;
-                        n_bytes -= n;
-                    }
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+    if ((ci = iget(inst, file->inode)) == NULL)    { return -1; }
 
-                    boff += inst->sb.block_size;
-                }
-            }
-        }
+    spin_lock(&ci->wlock);
+    status = flush_inode(inst, ci);
+    spin_unlock(&ci->wlock);
 
-        kfree(tiblock);
-        kfree(diblock);
-        kfree(iblock);
+    /* Open files keep the inode referenced, so iput() won't write back the new size and zones. */
+    if (status == 0) {
+        status = iwrite_back(inst, ci);
     }
 
-    kfree(block);
+    iput(inst, ci);
 
-    return n_bytes;
-}
+    if (status == 0) {
+        status = blk_flush(inst->adid);
+    }
 
-static s64 write(File *file, u8 *src, u64 offset, u64 n_bytes) {
-    return -1;
+    return status;
 }
 
-static s64 size(File *file) {
+/* An open file holds a reference so its inode stays in the cache between reads. */
+static s64 open(File *file) {
     Instance *inst;
-    Inode     inode;
+
+    if ((inst = get_instance(file->adid)) == NULL) { return -1; }
+
+    if ((file->fs_data = iget(inst, file->inode)) == NULL) { return -1; }
+
+    return 0;
+}
+
+/* Buffered writes go to disk on close; otherwise the buffer's reference would keep them in memory indefinitely. */
+static s64 release(File *file) {
+    Instance     *inst;
+    Cached_Inode *ci;
+    s64           status;
 
     inst = get_instance(file->adid);
+    ci   = file->fs_data;
 
-    blk_read(inst->adid,
-             OFFSET(inst->sb, file->inode),
-             (void*)&inode,
-             sizeof(inode));
+    spin_lock(&ci->wlock);
+    status = flush_inode(inst, ci);
+    spin_unlock(&ci->wlock);
+
+    iput(inst, ci);
+    file->fs_data = NULL;
 
-    return inode.size;
+    return status;
 }
@@ -1,6 +1,16 @@
 #include "gpu.h"
+#include "syscall.h"
 #include "driver.h"
 #include "kprint.h"
+#include "page.h"
+#include "machine.h"
+#include "blit.h"
+#include "utils.h"
+#include "kmalloc.h"
+#include "array.h"
+#include "lock.h"
+#include "sbi.h"
+#include "mmu.h"
 
 static Driver_State *find_gpu_driver(void) {
     Driver       *driver;
@@ -14,16 +24,36 @@ static Driver_State *find_gpu_driver(void) {
     return state;
 }
 
-s64 gpu_reset_display(void) {
+s64 gpu_set_cursor(u32 *pixels, u32 hot_x, u32 hot_y) {
     Driver_State *state;
 
-    if ((state = find_gpu_driver()) != NULL) {
-        return state->driver->gpu.reset_display(state);
+    if ((state = find_gpu_driver()) != NULL && state->driver->gpu.set_cursor != NULL) {
+        return state->driver->gpu.set_cursor(state, pixels, hot_x, hot_y);
     }
 
     return -1;
 }
 
+s64 gpu_move_cursor(u32 x, u32 y) {
+    Driver_State *state;
+
+    if ((state = find_gpu_driver()) != NULL && state->driver->gpu.move_cursor != NULL) {
+        return state->driver->gpu.move_cursor(state, x, y);
+    }
+
+    return -1;
+}
+
+static s64 reset_and_recompose(Driver_State *state);
+
+s64 gpu_reset_display(void) {
+    Driver_State *state;
+
+    if ((state = find_gpu_driver()) == NULL) { return -1; }
+
+    return reset_and_recompose(state);
+}
+
 s64 gpu_clear(u32 rgba_color) {
     Driver_State *state;
 
@@ -44,11 +74,12 @@ s64 gpu_get_rect(u32 *x, u32 *y, u32 *w, u32 *h) {
     return -1;
 }
 
-s64 gpu_pixels(u32 x, u32 y, u32 w, u32 h, u32 *pixels) {
+/* pixels is row-major with stride pixels per row, of which the first w are drawn. */
+s64 gpu_pixels(u32 x, u32 y, u32 w, u32 h, u32 stride, u32 *pixels) {
     Driver_State *state;
 
     if ((state = find_gpu_driver()) != NULL) {
-        return state->driver->gpu.pixels(state, x, y, w, h, pixels);
+        return state->driver->gpu.pixels(state, x, y, w, h, stride, pixels);
     }
 
     return -1;
@@ -74,87 +105,573 @@ s64 gpu_commit(void) {
     return -1;
 }
 
-static u8 ctx_bits;
+/*
+ * Compositor. Every context is a window with its own offscreen surface that
+ * all drawing goes into. Committing a window composites the part of the
+ * screen it damaged: background first, then every window that overlaps it
+ * from the bottom of the stack up, straight into the driver's back buffer.
+ * Windows never touch the screen directly, so one committing doesn't disturb
+ * any other.
+ */
+
+#define GPU_BACKGROUND (0xFF000000)
+#define GPU_CASCADE    (32)
+
+typedef struct {
+    u32 x;
+    u32 y;
+    u32 w;
+    u32 h;
+} Win_Rect;
+
+typedef struct {
+    Win_Rect  rect;    /* Screen coordinates. */
+    u32      *pixels;  /* rect.w x rect.h. Page-allocated so that it can be mapped. */
+    u64       size;    /* In bytes, page aligned. */
+    Process  *owner;
+    u64       mapped;  /* Where pixels sit in the owner's address space, 0 if not mapped. The owner draws behind our back. */
+    u32       damaged;
+    Win_Rect  damage;  /* Window coordinates. Valid if damaged. */
+} Window;
+
+static Window   *windows[GPU_MAX_WINDOWS]; /* Indexed by ctx. */
+static array_t   stacking;                 /* Window*, bottom first. */
+static Spinlock  windows_lock;             /* Also serializes every draw, present and reset in the driver. */
+static Win_Rect  screen;
+
+static Window *get_window(s64 ctx) {
+    if (ctx < 0 || ctx >= GPU_MAX_WINDOWS) { return NULL; }
+
+    return windows[ctx];
+}
+
+/* Only the process that created a window may draw into, commit, map or release it. */
+static Window *get_owned_window(s64 ctx, Process *proc) {
+    Window *win;
+
+    if ((win = get_window(ctx)) == NULL || win->owner != proc) { return NULL; }
+
+    return win;
+}
+
+static u32 intersect(Win_Rect *a, Win_Rect *b, Win_Rect *out) {
+    u32 x2;
+    u32 y2;
+
+    out->x = MAX(a->x, b->x);
+    out->y = MAX(a->y, b->y);
+    x2     = MIN(a->x + a->w, b->x + b->w);
+    y2     = MIN(a->y + a->h, b->y + b->h);
+
+    if (x2 <= out->x || y2 <= out->y) { return 0; }
+
+    out->w = x2 - out->x;
+    out->h = y2 - out->y;
+
+    return 1;
+}
+
+static void add_window_damage(Window *win, u32 x, u32 y, u32 w, u32 h) {
+    u32 x2;
+    u32 y2;
+
+    if (w == 0 || h == 0) { return; }
+
+    if (!win->damaged) {
+        win->damage.x = x;
+        win->damage.y = y;
+        win->damage.w = w;
+        win->damage.h = h;
+        win->damaged  = 1;
+        return;
+    }
+
+    x2 = MAX(win->damage.x + win->damage.w, x + w);
+    y2 = MAX(win->damage.y + win->damage.h, y + h);
+
+    win->damage.x = MIN(win->damage.x, x);
+    win->damage.y = MIN(win->damage.y, y);
+    win->damage.w = x2 - win->damage.x;
+    win->damage.h = y2 - win->damage.y;
+}
+
+/* Must be called with windows_lock held. */
+static void compose(Win_Rect *area) {
+    Win_Rect   r;
+    Win_Rect   part;
+    Window   **it;
+    Window    *win;
+
+    if (!intersect(area, &screen, &r)) { return; }
+
+    gpu_rect(r.x, r.y, r.w, r.h, GPU_BACKGROUND);
+
+    array_traverse(stacking, it) {
+        win = *it;
+
+        if (!intersect(&r, &win->rect, &part)) { continue; }
+
+        gpu_pixels(part.x, part.y, part.w, part.h, win->rect.w,
+                   win->pixels + (u64)(part.y - win->rect.y) * win->rect.w + (part.x - win->rect.x));
+    }
+}
+
+/* Picks up display size changes; everything has to be redrawn after one. Must be called with windows_lock held. */
+static void check_screen(void) {
+    Win_Rect now;
+
+    gpu_get_rect(&now.x, &now.y, &now.w, &now.h);
+
+    if (now.w != screen.w || now.h != screen.h) {
+        screen = now;
+        compose(&screen);
+    }
+}
+
+static void frame_commit(u32 force);
+
+/* Resets under windows_lock so that no one composes into the buffers the driver is replacing. */
+static s64 reset_and_recompose(Driver_State *state) {
+    spin_lock(&windows_lock);
+
+    if (state->driver->gpu.reset_display(state) != 0) {
+        spin_unlock(&windows_lock);
+        return -1;
+    }
+
+    /* The reset leaves a blank screen, but the windows still have their contents. */
+    if (stacking.elem_size != 0) {
+        gpu_get_rect(&screen.x, &screen.y, &screen.w, &screen.h);
+        compose(&screen);
+    }
+
+    frame_commit(1);
+
+    spin_unlock(&windows_lock);
+
+    return 0;
+}
+
+s64 gpu_ctx(Process *owner) {
+    Window   *win;
+    s64       ctx;
+    u32       cascade;
+
+    spin_lock(&windows_lock);
+
+    if (stacking.elem_size == 0) {
+        stacking = array_make(Window*);
+    }
+
+    gpu_get_rect(&screen.x, &screen.y, &screen.w, &screen.h);
+
+    for (ctx = 0; ctx < GPU_MAX_WINDOWS; ctx += 1) {
+        if (windows[ctx] == NULL) { break; }
+    }
+
+    if (ctx == GPU_MAX_WINDOWS) {
+        spin_unlock(&windows_lock);
+        return -1;
+    }
+
+    /* The first two windows split the screen; the rest cascade over them. */
+    win         = kmalloc(sizeof(*win));
+    memset(win, 0, sizeof(*win));
+    win->owner  = owner;
+    win->rect.w = screen.w / 2;
+    win->rect.h = screen.h;
+
+    if (ctx < 2) {
+        win->rect.x = ctx * win->rect.w;
+    } else {
+        cascade     = (ctx - 1) * GPU_CASCADE;
+        win->rect.x = MIN(cascade, screen.w - win->rect.w);
+        win->rect.y = MIN(cascade, screen.h / 2);
+        win->rect.h = screen.h - win->rect.y;
+    }
+
+    win->size   = ALIGN(4ULL * win->rect.w * win->rect.h, PAGE_SIZE);
+    win->pixels = alloc_pages(win->size / PAGE_SIZE);
+    blit_fill(win->pixels, win->rect.w, win->rect.w, win->rect.h, GPU_BACKGROUND);
+
+    windows[ctx] = win;
+    array_push(stacking, win);
+
+    compose(&win->rect);
+
+    spin_unlock(&windows_lock);
+
+    return ctx;
+}
+
+void gpu_ctx_release(s64 ctx, Process *proc) {
+    Window   *win;
+    Window  **it;
+    u32       i;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) == NULL) {
+        spin_unlock(&windows_lock);
+        return;
+    }
+
+    windows[ctx] = NULL;
+
+    i = 0;
+    array_traverse(stacking, it) {
+        if (*it == win) {
+            array_delete(stacking, i);
+            break;
+        }
+        i += 1;
+    }
+
+    /* Uncover whatever was underneath. */
+    compose(&win->rect);
+    frame_commit(0);
+
+    spin_unlock(&windows_lock);
+
+    /* Take the surface out of the owner's page table before its pages can be reused. */
+    if (win->mapped) {
+        mmu_unmap(win->owner->page_table, win->mapped, win->size);
+    }
+
+    free_pages(win->pixels);
+    kfree(win);
+}
+
+/* Called when proc goes away so that its windows don't outlive it. */
+void gpu_release_process(Process *proc) {
+    s64 ctx;
+
+    for (ctx = 0; ctx < GPU_MAX_WINDOWS; ctx += 1) {
+        gpu_ctx_release(ctx, proc);
+    }
+}
+
+void gpu_ctx_commit(s64 ctx, Process *proc) {
+    Window   *win;
+    Win_Rect  area;
 
-s64 gpu_ctx(void) {
-    switch (ctx_bits) {
-        case 0:
-        case 2:
-            ctx_bits |= 1 << 0;
-            gpu_reset_display();
+    spin_lock(&windows_lock);
+
+    check_screen();
+
+    if ((win = get_owned_window(ctx, proc)) != NULL) {
+        if (win->mapped) {
+            add_window_damage(win, 0, 0, win->rect.w, win->rect.h);
+        }
+
+        if (win->damaged) {
+            area.x       = win->rect.x + win->damage.x;
+            area.y       = win->rect.y + win->damage.y;
+            area.w       = win->damage.w;
+            area.h       = win->damage.h;
+            win->damaged = 0;
+
+            compose(&area);
+        }
+    }
+
+    frame_commit(0);
+
+    spin_unlock(&windows_lock);
+}
+
+/* Maps the surface into proc, which has to own ctx. Returns the user address, or 0 on failure. */
+u64 gpu_ctx_map(s64 ctx, Process *proc, u32 *w, u32 *h) {
+    Window *win;
+    u64     vaddr;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) == NULL) {
+        spin_unlock(&windows_lock);
+        return 0;
+    }
+
+    if (!win->mapped) {
+        if (mmu_map(proc->page_table, (u64)win->pixels, proc->virt_avail, win->size, PAGE_READ | PAGE_WRITE | PAGE_USER) != win->size / PAGE_SIZE) {
+            mmu_unmap(proc->page_table, proc->virt_avail, win->size);
+            spin_unlock(&windows_lock);
             return 0;
-        case 1:
-            ctx_bits |= 1 << 1;
-/*             gpu_reset_display(); */
-            return 1;
+        }
+
+        win->mapped       = proc->virt_avail;
+        proc->virt_avail += win->size;
     }
 
-    return -1;
+    *w    = win->rect.w;
+    *h    = win->rect.h;
+    vaddr = win->mapped;
+
+    spin_unlock(&windows_lock);
+
+    return vaddr;
 }
 
-void gpu_ctx_release(s64 ctx) {
-    ctx_bits &= ~(1 << ctx);
-    gpu_reset_display();
+void gpu_ctx_rect(s64 ctx, Process *proc, u32 x, u32 y, u32 w, u32 h, u32 rgba_color) {
+    Window *win;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) != NULL && x < win->rect.w && y < win->rect.h) {
+        w = MIN(w, win->rect.w - x);
+        h = MIN(h, win->rect.h - y);
+
+        blit_fill(win->pixels + (u64)y * win->rect.w + x, win->rect.w, w, h, rgba_color);
+        add_window_damage(win, x, y, w, h);
+    }
+
+    spin_unlock(&windows_lock);
 }
 
-void gpu_ctx_commit(s64 ctx) {
-    (void)ctx;
+void gpu_ctx_pixels(s64 ctx, Process *proc, u32 x, u32 y, u32 w, u32 h, u32 *pixels) {
+    Window *win;
+    u32     cw;
+    u32     ch;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) != NULL && x < win->rect.w && y < win->rect.h) {
+        cw = MIN(w, win->rect.w - x);
+        ch = MIN(h, win->rect.h - y);
+
+        blit_copy(win->pixels + (u64)y * win->rect.w + x, win->rect.w, pixels, w, cw, ch);
+        add_window_damage(win, x, y, cw, ch);
+    }
+
+    spin_unlock(&windows_lock);
+}
+
+/* x and y are relative to the window. */
+s64 gpu_ctx_move_cursor(s64 ctx, Process *proc, u32 x, u32 y) {
+    Window *win;
+    u32     sx;
+    u32     sy;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) == NULL) {
+        spin_unlock(&windows_lock);
+        return -1;
+    }
+
+    sx = win->rect.x + MIN(x, win->rect.w - 1);
+    sy = win->rect.y + MIN(y, win->rect.h - 1);
+
+    spin_unlock(&windows_lock);
+
+    return gpu_move_cursor(sx, sy);
+}
+
+/* ctx -1 is the whole screen. */
+void gpu_ctx_get_rect(s64 ctx, u32 *x, u32 *y, u32 *w, u32 *h) {
+    Window *win;
+
+    if (ctx == -1) {
+        gpu_get_rect(x, y, w, h);
+        return;
+    }
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_window(ctx)) != NULL) {
+        *x = win->rect.x;
+        *y = win->rect.y;
+        *w = win->rect.w;
+        *h = win->rect.h;
+    } else {
+        *x = *y = *w = *h = 0;
+    }
+
+    spin_unlock(&windows_lock);
+}
+
+void gpu_ctx_clear(s64 ctx, Process *proc, u32 rgba_color) {
+    Window *win;
+
+    spin_lock(&windows_lock);
+
+    if ((win = get_owned_window(ctx, proc)) != NULL) {
+        blit_fill(win->pixels, win->rect.w, win->rect.w, win->rect.h, rgba_color);
+        add_window_damage(win, 0, 0, win->rect.w, win->rect.h);
+    }
+
+    spin_unlock(&windows_lock);
+}
+
+/*
+ * Frame clock. Time is cut into GPU_FRAME_CYCLES frames counted from the
+ * first commit, and only the first commit in a frame is presented right
+ * away. Later ones leave their damage in the back buffer and are presented
+ * once the next frame starts: by the next commit, by a frame wait, or
+ * before a process blocks, whichever comes first. All of these run in
+ * process context under windows_lock, so a present never races compositing
+ * or another present. However often processes commit, the device sees at
+ * most one transfer per frame.
+ */
+
+#define GPU_FRAME_CYCLES (166666) /* 60Hz with the 10MHz timebase. */
+
+static Spinlock        frame_lock;
+static u64             frame_epoch;
+static u64             next_present; /* First frame that may present again. */
+static u32             frame_dirty;  /* Commits waiting for next_present. */
+static GPU_Frame_Stats frame_stats;
+
+/* Must be called with frame_lock held. */
+static u64 current_frame(void) {
+    u64 now;
+
+    now = sbicall(SBI_CLOCK);
+
+    if (frame_epoch == 0) {
+        frame_epoch = now;
+    }
+
+    return (now - frame_epoch) / GPU_FRAME_CYCLES;
+}
+
+/* Claims the current frame for a present. Must be called with frame_lock held. */
+static void claim_frame(u64 frame) {
+    next_present = frame + 1;
+    frame_dirty  = 0;
+}
+
+/*
+ * Must be called with windows_lock held, which keeps compose() out of the
+ * back buffer until it has been handed over. The transfer itself happens
+ * outside frame_lock so that frame queries don't spin on it.
+ */
+static void present(void) {
+    u64 start;
+    u64 cycles;
+
+    start = sbicall(SBI_CLOCK);
+
     gpu_commit();
+
+    cycles = sbicall(SBI_CLOCK) - start;
+
+    spin_lock(&frame_lock);
+
+    frame_stats.presented    += 1;
+    frame_stats.last_present  = cycles;
+    frame_stats.max_present   = MAX(frame_stats.max_present, cycles);
+
+    if (cycles > GPU_FRAME_CYCLES) {
+        frame_stats.overruns += 1;
+    }
+
+    spin_unlock(&frame_lock);
+}
+
+/* A forced commit presents even if this frame already has. Must be called with windows_lock held. */
+static void frame_commit(u32 force) {
+    u64 frame;
+
+    spin_lock(&frame_lock);
+
+    frame = current_frame();
+
+    if (!force && frame < next_present) {
+        frame_dirty            = 1;
+        frame_stats.coalesced += 1;
+
+        spin_unlock(&frame_lock);
+        return;
+    }
+
+    claim_frame(frame);
+
+    spin_unlock(&frame_lock);
+
+    present();
 }
 
-void gpu_ctx_rect(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 rgba_color) {
-    u32 cx;
-    u32 cy;
-    u32 cw;
-    u32 ch;
+/* Presents deferred commits once their frame has come. Called from frame waits and before blocking. */
+void gpu_frame_flush(void) {
+    u64 frame;
+
+    if (!frame_dirty) { return; }
+
+    spin_lock(&windows_lock);
+    spin_lock(&frame_lock);
+
+    frame = current_frame();
 
-    gpu_ctx_get_rect(ctx, &cx, &cy, &cw, &ch);
+    if (!frame_dirty || frame < next_present) {
+        spin_unlock(&frame_lock);
+        spin_unlock(&windows_lock);
+        return;
+    }
+
+    claim_frame(frame);
+
+    spin_unlock(&frame_lock);
 
-    x = MIN(cx + x, cx + cw);
-    y = MIN(cy + y, cy + ch);
-    w = MIN(w, (cx + cw) - x);
-    h = MIN(h, (cx + ch) - y);
+    present();
 
-    gpu_rect(x, y, w, h, rgba_color);
+    spin_unlock(&windows_lock);
 }
 
-void gpu_ctx_pixels(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 *pixels) {
-    u32 cx;
-    u32 cy;
-    u32 cw;
-    u32 ch;
+/* Returns 1 if commits are waiting to be presented, with the cycles until their frame starts in left. */
+u32 gpu_frame_pending(u64 *left) {
+    u64 start;
+    u64 now;
+    u32 pending;
+
+    spin_lock(&frame_lock);
+
+    current_frame();
+
+    pending = frame_dirty;
+    start   = frame_epoch + next_present * GPU_FRAME_CYCLES;
+    now     = sbicall(SBI_CLOCK);
 
-    gpu_ctx_get_rect(ctx, &cx, &cy, &cw, &ch);
+    spin_unlock(&frame_lock);
 
-    x = MIN(cx + x, cx + cw);
-    y = MIN(cy + y, cy + ch);
-    w = MIN(w, (cx + cw) - x);
-    h = MIN(h, (cx + ch) - y);
+    *left = now >= start ? 0 : start - now;
 
-    gpu_pixels(x, y, w, h, pixels);
+    return pending;
 }
 
-void gpu_ctx_get_rect(s64 ctx, u32 *x, u32 *y, u32 *w, u32 *h) {
-    u32 gx;
-    u32 gy;
-    u32 gw;
-    u32 gh;
+u64 gpu_frame_now(void) {
+    u64 frame;
 
-    gpu_get_rect(&gx, &gy, &gw, &gh);
+    spin_lock(&frame_lock);
+    frame = current_frame();
+    spin_unlock(&frame_lock);
 
-    *x = ctx * (gw / 2);
-    *y = gy;
-    *w = gw / 2;
-    *h = gh;
+    return frame;
 }
 
-void gpu_ctx_clear(s64 ctx, u32 rgba_color) {
-    u32 x;
-    u32 y;
-    u32 w;
-    u32 h;
+/* Cycles until frame starts, 0 if it already has. */
+u64 gpu_frame_until(u64 frame) {
+    u64 start;
+    u64 now;
+
+    spin_lock(&frame_lock);
+
+    current_frame();
+
+    start = frame_epoch + frame * GPU_FRAME_CYCLES;
+    now   = sbicall(SBI_CLOCK);
+
+    spin_unlock(&frame_lock);
+
+    return now >= start ? 0 : start - now;
+}
+
+void gpu_frame_stats(GPU_Frame_Stats *stats) {
+    spin_lock(&frame_lock);
 
-    gpu_ctx_get_rect(ctx, &x, &y, &w, &h);
+    *stats              = frame_stats;
+    stats->frame        = current_frame();
+    stats->frame_cycles = GPU_FRAME_CYCLES;
 
-    gpu_rect(x, y, w, h, rgba_color);
+    spin_unlock(&frame_lock);
 }
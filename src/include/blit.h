@@ -0,0 +1,15 @@
+#ifndef __BLIT_H__
+#define __BLIT_H__
+
+#include "common.h"
+
+/*
+ * Rectangle operations on 32-bit RGBA surfaces (R in the low byte, A in the
+ * high byte). Strides are in pixels, sources are row-major and nothing is
+ * clipped here, so callers clip w and h to both surfaces first.
+ */
+
+void blit_fill(u32 *dst, u32 dst_stride, u32 w, u32 h, u32 rgba_color);
+void blit_copy(u32 *dst, u32 dst_stride, const u32 *src, u32 src_stride, u32 w, u32 h);
+
+#endif
@@ -3,7 +3,20 @@
 
 #include "common.h"
 
-s64 blk_read(u32 adid, u64 offset, u8 *buff, u64 len);
-s64 blk_write(u32 adid, u64 offset, const u8 *buff, u64 len);
+typedef struct Blk_Request Blk_Request;
+
+Blk_Request *blk_read_async(u32 adid, u64 offset, u8 *buff, u64 len);
+Blk_Request *blk_write_async(u32 adid, u64 offset, const u8 *buff, u64 len);
+s64          blk_wait(u32 adid, Blk_Request *rq);
+void         blk_unplug(u32 adid);
+s64          blk_read(u32 adid, u64 offset, u8 *buff, u64 len);
+s64          blk_write(u32 adid, u64 offset, const u8 *buff, u64 len);
+s64          blk_flush(u32 adid);
+s64          blk_discard(u32 adid, u64 offset, u64 len);
+s64          blk_write_zeroes(u32 adid, u64 offset, u64 len);
+s64          blk_get_deadline(u32 adid, u64 *cycles);
+s64          blk_set_deadline(u32 adid, u64 cycles);
+s64          blk_get_poll(u32 adid, u64 *cycles);
+s64          blk_set_poll(u32 adid, u64 cycles);
 
 #endif
@@ -31,30 +31,51 @@ typedef struct {
     s64 name(Driver_State *arg1_name, u64 arg2_name, u8 *arg3_name, u64 arg4_name)
 #define DRV_BLK_WRITE_FN(name, arg1_name, arg2_name, arg3_name, arg4_name) \
     s64 name(Driver_State *arg1_name, u64 arg2_name, const u8 *arg3_name, u64 arg4_name)
+#define DRV_BLK_GET_POLL_FN(name, arg1_name) \
+    u64 name(Driver_State *arg1_name)
+#define DRV_BLK_SET_POLL_FN(name, arg1_name, arg2_name) \
+    s64 name(Driver_State *arg1_name, u64 arg2_name)
+#define DRV_BLK_FLUSH_FN(name, arg1_name) \
+    s64 name(Driver_State *arg1_name)
+#define DRV_BLK_DISCARD_FN(name, arg1_name, arg2_name, arg3_name) \
+    s64 name(Driver_State *arg1_name, u64 arg2_name, u64 arg3_name)
+#define DRV_BLK_WRITE_ZEROES_FN(name, arg1_name, arg2_name, arg3_name) \
+    s64 name(Driver_State *arg1_name, u64 arg2_name, u64 arg3_name)
 #define DRV_GPU_RESET_DISPLAY_FN(name, arg1_name) \
     s64 name(Driver_State *arg1_name)
 #define DRV_GPU_CLEAR_FN(name, arg1_name, arg2_name) \
     s64 name(Driver_State *arg1_name, u32 arg2_name)
 #define DRV_GPU_GET_RECT_FN(name, arg1_name, arg2_name, arg3_name, arg4_name, arg5_name) \
     s64 name(Driver_State *arg1_name, u32 *arg2_name, u32 *arg3_name, u32 *arg4_name, u32 *arg5_name)
-#define DRV_GPU_PIXELS_FN(name, arg1_name, arg2_name, arg3_name, arg4_name, arg5_name, arg6_name) \
-    s64 name(Driver_State *arg1_name, u32 arg2_name, u32 arg3_name, u32 arg4_name, u32 arg5_name, u32 *arg6_name)
+#define DRV_GPU_PIXELS_FN(name, arg1_name, arg2_name, arg3_name, arg4_name, arg5_name, arg6_name, arg7_name) \
+    s64 name(Driver_State *arg1_name, u32 arg2_name, u32 arg3_name, u32 arg4_name, u32 arg5_name, u32 arg6_name, u32 *arg7_name)
 #define DRV_GPU_RECT_FN(name, arg1_name, arg2_name, arg3_name, arg4_name, arg5_name, arg6_name) \
     s64 name(Driver_State *arg1_name, u32 arg2_name, u32 arg3_name, u32 arg4_name, u32 arg5_name, u32 arg6_name)
 #define DRV_GPU_COMMIT_FN(name, arg1_name) \
     s64 name(Driver_State *arg1_name)
+#define DRV_GPU_SET_CURSOR_FN(name, arg1_name, arg2_name, arg3_name, arg4_name) \
+    s64 name(Driver_State *arg1_name, u32 *arg2_name, u32 arg3_name, u32 arg4_name)
+#define DRV_GPU_MOVE_CURSOR_FN(name, arg1_name, arg2_name, arg3_name) \
+    s64 name(Driver_State *arg1_name, u32 arg2_name, u32 arg3_name)
 
 typedef s64 (*Driver_Init_Fn)(Driver_State*);
 typedef s64 (*Driver_IRQ_Fn)(Driver_State*);
 typedef s64 (*Driver_RNG_Service_Fn)(Driver_State*, u8*, u64);
 typedef s64 (*Driver_BLOCK_Read_Fn)(Driver_State*, u64, u8*, u64);
 typedef s64 (*Driver_BLOCK_Write_Fn)(Driver_State*, u64, const u8*, u64);
+typedef u64 (*Driver_BLOCK_Get_Poll_Fn)(Driver_State*);
+typedef s64 (*Driver_BLOCK_Set_Poll_Fn)(Driver_State*, u64);
+typedef s64 (*Driver_BLOCK_Flush_Fn)(Driver_State*);
+typedef s64 (*Driver_BLOCK_Discard_Fn)(Driver_State*, u64, u64);
+typedef s64 (*Driver_BLOCK_Write_Zeroes_Fn)(Driver_State*, u64, u64);
 typedef s64 (*Driver_GPU_Reset_Display_Fn)(Driver_State*);
 typedef s64 (*Driver_GPU_Clear_Fn)(Driver_State*, u32);
 typedef s64 (*Driver_GPU_Get_Rect_Fn)(Driver_State*, u32*, u32*, u32*, u32*);
-typedef s64 (*Driver_GPU_Pixels_Fn)(Driver_State*, u32, u32, u32, u32, u32*);
+typedef s64 (*Driver_GPU_Pixels_Fn)(Driver_State*, u32, u32, u32, u32, u32, u32*);
 typedef s64 (*Driver_GPU_Rect_Fn)(Driver_State*, u32, u32, u32, u32, u32);
 typedef s64 (*Driver_GPU_Commit_Fn)(Driver_State*);
+typedef s64 (*Driver_GPU_Set_Cursor_Fn)(Driver_State*, u32*, u32, u32);
+typedef s64 (*Driver_GPU_Move_Cursor_Fn)(Driver_State*, u32, u32);
 
 typedef struct Driver {
     const char     *name;
@@ -67,8 +88,13 @@ typedef struct Driver {
             Driver_RNG_Service_Fn service;
         } rng;
         struct {
-            Driver_BLOCK_Read_Fn  read;
-            Driver_BLOCK_Write_Fn write;
+            Driver_BLOCK_Read_Fn         read;
+            Driver_BLOCK_Write_Fn        write;
+            Driver_BLOCK_Get_Poll_Fn     get_poll;
+            Driver_BLOCK_Set_Poll_Fn     set_poll;
+            Driver_BLOCK_Flush_Fn        flush;
+            Driver_BLOCK_Discard_Fn      discard;
+            Driver_BLOCK_Write_Zeroes_Fn write_zeroes;
         } block;
         struct {
             Driver_GPU_Reset_Display_Fn reset_display;
@@ -77,6 +103,8 @@ typedef struct Driver {
             Driver_GPU_Pixels_Fn        pixels;
             Driver_GPU_Rect_Fn          rect;
             Driver_GPU_Commit_Fn        commit;
+            Driver_GPU_Set_Cursor_Fn    set_cursor;
+            Driver_GPU_Move_Cursor_Fn   move_cursor;
         } gpu;
         struct {
         } input;
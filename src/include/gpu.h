@@ -2,19 +2,31 @@
 #define __GPU_H__
 
 #include "common.h"
+#include "syscall.h"
+#include "process.h"
 
 s64  gpu_reset_display(void);
 s64  gpu_clear(u32 rgba_color);
 s64  gpu_get_rect(u32 *x, u32 *y, u32 *w, u32 *h);
-s64  gpu_pixels(u32 x, u32 y, u32 w, u32 h, u32 *pixels);
+s64  gpu_pixels(u32 x, u32 y, u32 w, u32 h, u32 stride, u32 *pixels);
 s64  gpu_rect(u32 x, u32 y, u32 w, u32 h, u32 rgba_color);
 s64  gpu_commit(void);
-s64  gpu_ctx(void);
-void gpu_ctx_release(s64 ctx);
-void gpu_ctx_rect(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 rgba_color);
-void gpu_ctx_pixels(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 *pixels);
+s64  gpu_set_cursor(u32 *pixels, u32 hot_x, u32 hot_y);
+s64  gpu_move_cursor(u32 x, u32 y);
+s64  gpu_ctx(Process *owner);
+void gpu_ctx_release(s64 ctx, Process *proc);
+void gpu_release_process(Process *proc);
+void gpu_ctx_rect(s64 ctx, Process *proc, u32 x, u32 y, u32 w, u32 h, u32 rgba_color);
+void gpu_ctx_pixels(s64 ctx, Process *proc, u32 x, u32 y, u32 w, u32 h, u32 *pixels);
 void gpu_ctx_get_rect(s64 ctx, u32 *x, u32 *y, u32 *w, u32 *h);
-void gpu_ctx_commit(s64 ctx);
-void gpu_ctx_clear(s64 ctx, u32 rgba_color);
+void gpu_ctx_commit(s64 ctx, Process *proc);
+void gpu_ctx_clear(s64 ctx, Process *proc, u32 rgba_color);
+u64  gpu_ctx_map(s64 ctx, Process *proc, u32 *w, u32 *h);
+s64  gpu_ctx_move_cursor(s64 ctx, Process *proc, u32 x, u32 y);
+void gpu_frame_flush(void);
+u32  gpu_frame_pending(u64 *left);
+u64  gpu_frame_now(void);
+u64  gpu_frame_until(u64 frame);
+void gpu_frame_stats(GPU_Frame_Stats *stats);
 
 #endif
@@ -42,11 +42,15 @@
 
 #define CSR_READ(var, csr)    asm volatile("csrr %0, " csr : "=r"(var))
 #define CSR_WRITE(csr, var)   asm volatile("csrw " csr ", %0" :: "r"(var))
+#define CSR_SET(csr, bits)    asm volatile("csrs " csr ", %0" :: "r"(bits))
+#define CSR_READ_CLEAR(var, csr, bits) \
+                              asm volatile("csrrc %0, " csr ", %1" : "=r"(var) : "r"(bits))
 #define SFENCE()              asm volatile("sfence.vma");
 #define SFENCE_ASID(x)        asm volatile("sfence.vma zero, %0" :: "r"(x))
 #define SFENCE_VMA(x)         asm volatile("sfence.vma %0, zero" :: "r"(x))
 #define SFENCE_ALL(vma, asid) asm volatile("sfence.vma %0, %1" :: "r"(vma), "r"(asid))
 #define WAIT_FOR_INTERRUPT()  asm volatile("wfi")
+#define MEMORY_FENCE()        asm volatile("fence" ::: "memory")
 #define MRET()                asm volatile("mret")
 
 
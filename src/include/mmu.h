@@ -32,6 +32,7 @@ extern Page_Table *kernel_pt;
 void init_mmu(void);
 void activate_mmu(void);
 u64  mmu_map(Page_Table *pt, u64 paddr, u64 vaddr, u64 size, u64 bits);
+void mmu_unmap(Page_Table *pt, u64 vaddr, u64 size);
 u64  virt_to_phys(Page_Table *pt, u64 vaddr);
 void user_to_kernel(void *dst, const void *src, u64 len);
 void kernel_to_user(void *dst, const void *src, u64 len);
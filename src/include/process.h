@@ -5,8 +5,11 @@
 #include "machine.h"
 #include "mmu.h"
 #include "lock.h"
+#include "vfs.h"
+#include "syscall.h"
 
 #define MAX_PROCS (32)
+#define MAX_FDS   (16)
 
 typedef struct {
     u64    gpregs[32];
@@ -40,6 +43,12 @@ enum {
     PROC_IDLE,
 };
 
+typedef struct {
+    Ring_Header *hdr;       /* Kernel address of the shared pages. */
+    u32          n_entries; /* Our copy; the one in hdr is only for the process to read. */
+    array_t      parked;    /* Ring_SQE: RING_SQE_WAIT input pops with nothing to pop yet. */
+} Syscall_Ring;
+
 typedef struct {
     Process_Frame  frame;
     u32            state;
@@ -56,6 +65,10 @@ typedef struct {
     u32            waiting_on;
     void          *image;
     u64            virt_avail;
+    Path_Cache     path_cache;
+    Open_File     *fds[MAX_FDS];
+    Syscall_Ring  *ring;
+    u64            frame_wait; /* Frame SYS_GPU_WAIT_FRAME is sleeping until, 0 if none. */
 } Process;
 
 extern u16      pid_count;
@@ -64,6 +77,7 @@ extern Spinlock procs_lock;
 
 void idle_process_fn(void);
 Process * new_process(u32 kind);
+void release_process(Process *proc);
 void free_process(Process *proc);
 void start_process(Process *proc, u32 which_hart);
 
@@ -20,9 +20,23 @@
     X(SYS_GPU_CTX_GET_RECT, "Get the rectangle of a GPU context")                       \
     X(SYS_GPU_COMMIT,       "Commit GPU updates")                                       \
     X(SYS_GPU_CLEAR,        "Clear window to a color")                                  \
+    X(SYS_GPU_MAP_CTX,      "Map a GPU context's pixels into the process")              \
+    X(SYS_GPU_SET_CURSOR,   "Set the hardware cursor image and hotspot")                \
+    X(SYS_GPU_MOVE_CURSOR,  "Move the hardware cursor within a GPU context")            \
+    X(SYS_GPU_WAIT_FRAME,   "Wait for the next frame boundary and get frame stats")     \
     X(SYS_FILE_SIZE,        "Get the size of a file")                                   \
     X(SYS_FILE_READ,        "Read bytes from a file")                                   \
-    X(SYS_MAP_MEM,          "Map memory into the process")
+    X(SYS_MAP_MEM,          "Map memory into the process")                              \
+    X(SYS_OPEN,             "Open a file and get a file descriptor")                    \
+    X(SYS_READ,             "Read bytes at a file descriptor's offset")                 \
+    X(SYS_PREAD,            "Read bytes at a given offset in an open file")             \
+    X(SYS_SEEK,             "Set the offset of a file descriptor")                      \
+    X(SYS_CLOSE,            "Close a file descriptor")                                  \
+    X(SYS_READV,            "Read into several buffers at a file descriptor's offset")  \
+    X(SYS_WRITEV,           "Write from several buffers at a file descriptor's offset") \
+    X(SYS_PREADV,           "Read into several buffers at a given offset")              \
+    X(SYS_RING_SETUP,       "Map a syscall submission/completion ring")                 \
+    X(SYS_RING_ENTER,       "Submit ring entries and wait for completions")
 
 #define SYSCALL_ENUM(s, d) s,
 enum {
@@ -31,6 +45,78 @@ enum {
 };
 #undef SYSCALL_ENUM
 
+enum {
+    SEEK_SET,
+    SEEK_CUR,
+    SEEK_END,
+};
+
+#define IOV_MAX (64)
+
+/* GPU contexts are windows; ctx -1 stands for the whole screen in SYS_GPU_CTX_GET_RECT. */
+#define GPU_MAX_WINDOWS (32)
+
+/* Cursor images are GPU_CURSOR_SIZE x GPU_CURSOR_SIZE RGBA pixels. */
+#define GPU_CURSOR_SIZE (64)
+
+/* Filled in by SYS_GPU_WAIT_FRAME when given a pointer. Times are in clock cycles. */
+typedef struct {
+    u64 frame;        /* Frames since the clock started. */
+    u64 frame_cycles; /* Length of a frame. */
+    u64 presented;    /* Frames that went to the device. */
+    u64 coalesced;    /* Commits folded into a later frame's present. */
+    u64 last_present; /* How long the most recent present took. */
+    u64 max_present;
+    u64 overruns;     /* Presents that took longer than a frame. */
+} GPU_Frame_Stats;
+
+typedef struct {
+    void *base;
+    u64   len;
+} IO_Vec;
+
+/*
+ * Syscall ring. SYS_RING_SETUP(n_entries) maps one of these into the process
+ * and returns its address. The submission queue (sq) follows the header and
+ * the completion queue (cq, twice as long) follows that. Each submission is
+ * an ordinary syscall number and its arguments; SYS_RING_ENTER(to_submit,
+ * min_complete) runs up to to_submit of them in one trap and returns the
+ * number of completions waiting to be reaped.
+ *
+ * The process owns sq_tail and cq_head, the kernel owns sq_head and cq_tail.
+ * Indices run freely and are masked with (n_entries - 1) or
+ * (2 * n_entries - 1).
+ */
+#define RING_MAX_ENTRIES (256)
+
+/* SYS_INPUT_POP only: rather than completing with -1 when there's no event, complete when one arrives. */
+#define RING_SQE_WAIT (1 << 0)
+
+typedef struct {
+    u32 sq_head;
+    u32 sq_tail;
+    u32 cq_head;
+    u32 cq_tail;
+    u32 n_entries;
+    u32 _pad[3];
+} Ring_Header;
+
+typedef struct {
+    u32 call;
+    u32 flags;
+    u64 user_data;
+    u64 args[6];
+} Ring_SQE;
+
+typedef struct {
+    u64 user_data;
+    s64 result;
+} Ring_CQE;
+
+#define RING_SQ(hdr)   ((Ring_SQE*)((u8*)(hdr) + sizeof(Ring_Header)))
+#define RING_CQ(hdr)   ((Ring_CQE*)(RING_SQ(hdr) + (hdr)->n_entries))
+#define RING_SIZE(n)   (sizeof(Ring_Header) + (n) * sizeof(Ring_SQE) + 2 * (n) * sizeof(Ring_CQE))
+
 __attribute__((noipa))
 static inline s64 syscall(u32 call, ...) {
     s64 ret;
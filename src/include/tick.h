@@ -7,6 +7,7 @@
 
 void init_tick(void);
 void force_tick(u32 hart);
+void tick_within(u32 hart, u64 n_cycles);
 s64 do_tick(u32 hart);
 
 #endif
@@ -6,6 +6,7 @@
 
 u64      strlen(const char *s);
 s64      strcmp(const char *a, const char *b);
+s64      strncmp(const char *a, const char *b, u64 n);
 void     strcpy(char *dst, const char *src);
 void     strcat(char *dst, const char *src);
 char    *strdup(const char *s);
@@ -40,6 +41,18 @@ static inline s32 is_print(s32 c) {
     return (((u32)c) - 0x20) < 0x5f;
 }
 
+/* Index of the lowest set bit. x must not be 0. */
+static inline u32 ctz64(u64 x) {
+    static const u8 debruijn[64] = {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+    };
+
+    return debruijn[((x & -x) * 0x022fdd63cc95386dULL) >> 58];
+}
+
 static inline u64 bswap64(u64 val) {
   return
       ((val & 0xFF00000000000000ULL) >> 56ULL) |
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "array.h"
+#include "lock.h"
 
 enum {
     FILE_REGULAR,
@@ -51,8 +52,32 @@ typedef struct File {
     u32          kind;
     u32          fs;
     array_t      dir_entries;
+    u32          populated;   /* 0 until the FS has filled in all of dir_entries (see vfs_populate()). */
+    Spinlock     populate_lock; /* Held while the FS reads this directory in. */
+    u64          name_hash;
+    struct File *hash_next;   /* Chain in the dentry cache bucket for (parent, name). */
+    u32          open_count;  /* Open_Files referring to this File (see file_open()). */
+    void        *fs_data;     /* Owned by the FS between its open and release hooks. */
 } File;
 
+/* One open() of a File. Lives in a process's fd table. */
+typedef struct {
+    File *file;
+    u64   offset;
+} Open_File;
+
+/*
+ * Remembers the directory that the last lookup through it ended in, so that
+ * repeated lookups under the same directory skip the walk from the root.
+ * Zero-initialize before first use.
+ */
+typedef struct {
+    File *dir;
+    u64   generation;
+    u32   len;
+    char  prefix[256];
+} Path_Cache;
+
 typedef struct {
     char  name[32];
     s64 (*identify)(u32);
@@ -61,6 +86,11 @@ typedef struct {
     s64 (*read)(File*, u8*, u64, u64);
     s64 (*write)(File*, u8*, u64, u64);
     s64 (*size)(File*);
+    s64 (*populate)(File*);
+    s64 (*lookup)(File*, const char*);
+    s64 (*sync)(File*);
+    s64 (*open)(File*);
+    s64 (*release)(File*);
 } FS_Impl;
 
 void init_vfs(void);
@@ -68,13 +98,20 @@ void init_vfs(void);
 void  fs_impl(u32 which_fs, FS_Impl impl);
 File *vfs_new_file(const char *name, u32 kind, u32 adid);
 void  vfs_add_dir_entry(File *dir, File *entry);
+File *vfs_find_dir_entry(File *dir, const char *name);
 void  vfs_file_delete(File *f);
+void  vfs_populate(File *dir);
+File *vfs_lookup_child(File *dir, const char *name);
 File *get_file(const char *path);
+File *get_file_cached(Path_Cache *cache, const char *path);
 s64   get_file_path(File *file, char *buff);
 s64   path_dirname(const char *path, char *buff);
 s64   file_create(File *dir, const char *name, u32 kind);
 s64   file_read(File *file, u8 *dst, u64 offset, u64 n_bytes);
 s64   file_write(File *file, u8 *src, u64 offset, u64 n_bytes);
 s64   file_size(File *file);
+s64   file_sync(File *file);
+s64   file_open(File *file);
+void  file_release(File *file);
 
 #endif
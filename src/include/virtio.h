@@ -2,6 +2,7 @@
 #define __VIRTIO_H__
 
 #include "common.h"
+#include "lock.h"
 
 
 #define VIRTIO_PCI_CAP_COMMON_CFG (1)  /* Common configuration          */
@@ -16,6 +17,11 @@
 #define VIRTIO_DEV_STATUS_DRIVER_OK   (1 << 2)
 #define VIRTIO_DEV_STATUS_FEATURES_OK (1 << 3)
 
+#define VIRTIO_F_VERSION_1   (32)
+#define VIRTIO_F_RING_PACKED (34)
+
+#define VIRTIO_FEATURE(bit) (1ULL << (bit))
+
 #define BAR_NOTIFY_CAP(offset, queue_notify_off, notify_off_multiplier) \
     ((offset) + (queue_notify_off) * (notify_off_multiplier))
 
@@ -106,6 +112,26 @@ typedef struct {
 } VirtQ_Used_Ring;
 
 
+#define VIRTQ_DESC_F_AVAIL (1 << 7)  /* Packed ring: matches the driver's wrap counter when made available. */
+#define VIRTQ_DESC_F_USED  (1 << 15) /* Packed ring: matches the device's wrap counter when marked used.    */
+
+typedef struct {
+   u64 addr;   /* Buffer address (guest-physical).        */
+   u32 len;    /* Buffer length.                          */
+   u16 id;     /* Buffer ID.                              */
+   u16 flags;  /* NEXT/WRITE/INDIRECT plus AVAIL and USED */
+} VirtQ_Packed_Descriptor;
+
+#define VIRTQ_EVENT_F_ENABLE  (0)
+#define VIRTQ_EVENT_F_DISABLE (1)
+#define VIRTQ_EVENT_F_DESC    (2)
+
+typedef struct {
+   u16 off_wrap;
+   u16 flags;
+} VirtQ_Event_Suppress;
+
+
 typedef struct {
     volatile VirtIO_PCI_Common_Config     *pci_common;
     volatile void                         *pci_common_bar;
@@ -119,9 +145,50 @@ typedef struct {
     VirtQ_Available_Ring                  *driver_ring;
     VirtQ_Used_Ring                       *device_ring;
     u16                                    used_idx;
+    u64                                    features;
 } VirtIO_Device_Info;
 
-void virtio_get_device_info(VirtIO_Device_Info *info, void *pci_ecam);
+
+typedef struct {
+    u64 addr;  /* Guest-physical.           */
+    u32 len;
+    u16 flags; /* VIRTQ_DESC_F_WRITE or 0.  */
+} VirtIO_Buffer;
+
+typedef struct {
+    u16                               index;
+    u16                               size;
+    u32                               packed;
+    volatile u32                     *notify_addr;
+    Spinlock                          lock;
+
+    /* Split layout */
+    VirtIO_Descriptor                *descriptor_table;
+    volatile VirtQ_Available_Ring    *driver_ring;
+    volatile VirtQ_Used_Ring         *device_ring;
+
+    /* Packed layout */
+    volatile VirtQ_Packed_Descriptor *packed_ring;
+    volatile VirtQ_Event_Suppress    *driver_event;
+    volatile VirtQ_Event_Suppress    *device_event;
+    u16                               avail_wrap;
+    u16                               used_wrap;
+
+    u16                               desc_idx;  /* Next packed ring slot to fill.                       */
+    u16                               used_idx;  /* Next used ring entry (split) or slot (packed).       */
+    u16                               n_free;    /* Free descriptors.                                    */
+    u16                               free_head; /* Head of the free descriptor (split) or ID (packed) list. */
+    u16                              *free_next;
+    u16                              *chain_len; /* Descriptors per in-flight buffer ID.                 */
+    void                            **cookies;   /* Caller data per in-flight buffer ID.                 */
+} VirtIO_Queue;
+
+void   virtio_get_device_info(VirtIO_Device_Info *info, void *pci_ecam);
+u64    virtio_negotiate_features(VirtIO_Device_Info *info, u64 wanted);
+s64    virtio_queue_init(VirtIO_Device_Info *info, VirtIO_Queue *queue, u16 index);
+s64    virtio_queue_submit(VirtIO_Queue *queue, VirtIO_Buffer *bufs, u32 n_bufs, void *cookie);
+void   virtio_queue_notify(VirtIO_Queue *queue);
+void  *virtio_queue_pop_used(VirtIO_Queue *queue, u32 *len);
 
 
 #endif
@@ -14,6 +14,7 @@
 #include "sched.h"
 #include "vfs.h"
 #include "elf.h"
+#include "driver.h"
 
 static void _do_tree(File *f, u32 lvl, s32 last) {
     array_t   back;
@@ -53,6 +54,7 @@ static void _do_tree(File *f, u32 lvl, s32 last) {
 
     if (f->kind == FILE_DIRECTORY) {
         kprint("/\n");
+        vfs_populate(f);
         array_traverse(f->dir_entries, it) {
             if (strcmp((*it)->name, ".")  != 0
             &&  strcmp((*it)->name, "..") != 0) {
@@ -144,6 +146,10 @@ static void do_cmd(array_t words) {
     File                        **fit;
     s64                           file_len;
     s32                           hart;
+    Driver_State                **sit;
+    u32                           n;
+    u64                           cycles;
+    GPU_Frame_Stats               frames;
 
     cmd = array_len(words) == 0 ? "" : *(char**)array_item(words, 0);
 
@@ -196,6 +202,14 @@ static void do_cmd(array_t words) {
         *((volatile u32*)NULL) = 123;
     } else if (strcmp(cmd, "display-reset") == 0) {
         gpu_reset_display();
+    } else if (strcmp(cmd, "frames") == 0) {
+        gpu_frame_stats(&frames);
+        kprint("frame:        %U (%U cycles each)\n", frames.frame, frames.frame_cycles);
+        kprint("presented:    %U\n", frames.presented);
+        kprint("coalesced:    %U\n", frames.coalesced);
+        kprint("last present: %U cycles\n", frames.last_present);
+        kprint("max present:  %U cycles\n", frames.max_present);
+        kprint("overruns:     %U\n", frames.overruns);
     } else if (strcmp(cmd, "procs") == 0) {
         do {
             kprint(PR_CLS PR_CURSOR_HOME);
@@ -255,6 +269,7 @@ out:;
             if (f->kind != FILE_DIRECTORY) {
                 kprint("argument is not a directory\n");
             } else {
+                vfs_populate(f);
                 array_traverse(f->dir_entries, fit) {
                     kprint("%s%s (%UB)\n", (*fit)->name, (*fit)->kind == FILE_DIRECTORY ? "/" : "", file_size(*fit));
                 }
@@ -319,6 +334,14 @@ out:;
                 if (f->kind != FILE_REGULAR) {
                     kprint("file is not a regular file\n");
                 } else {
+                    file_len = file_size(f);
+                    bytes    = *(u8**)array_item(words, 2);
+
+                    if (file_len == -1
+                    ||  file_write(f, bytes, file_len, strlen((char*)bytes)) == -1
+                    ||  file_sync(f) != 0) {
+                        kprint("an error occurred\n");
+                    }
                 }
             }
         }
@@ -347,22 +370,69 @@ out:;
                 }
             }
         }
+    } else if (strcmp(cmd, "blkpoll") == 0) {
+        if (array_len(words) == 2) {
+            kprint("missing CYCLES argument\n");
+        } else {
+            n = 0;
+            FOR_DRIVER_STATE(sit) {
+                if ((*sit)->driver->type != DRV_BLOCK) { continue; }
+
+                if (array_len(words) < 2) {
+                    if (blk_get_poll((*sit)->active_device_id, &cycles) == 0) {
+                        kprint("%m%-4u%_  ADID 0x%x  poll: %y%U%_ cycles\n", n, (*sit)->active_device_id, cycles);
+                    }
+                } else if (n == (u32)stoi(*(char**)array_item(words, 1))) {
+                    if (blk_set_poll((*sit)->active_device_id, stoi(*(char**)array_item(words, 2))) != 0) {
+                        kprint("could not set poll mode\n");
+                    }
+                    break;
+                }
+
+                n += 1;
+            }
+        }
+    } else if (strcmp(cmd, "blkdeadline") == 0) {
+        if (array_len(words) == 2) {
+            kprint("missing CYCLES argument\n");
+        } else {
+            n = 0;
+            FOR_DRIVER_STATE(sit) {
+                if ((*sit)->driver->type != DRV_BLOCK) { continue; }
+
+                if (array_len(words) < 2) {
+                    if (blk_get_deadline((*sit)->active_device_id, &cycles) == 0) {
+                        kprint("%m%-4u%_  ADID 0x%x  deadline: %y%U%_ cycles\n", n, (*sit)->active_device_id, cycles);
+                    }
+                } else if (n == (u32)stoi(*(char**)array_item(words, 1))) {
+                    if (blk_set_deadline((*sit)->active_device_id, stoi(*(char**)array_item(words, 2))) != 0) {
+                        kprint("could not set deadline\n");
+                    }
+                    break;
+                }
+
+                n += 1;
+            }
+        }
     } else if (strcmp(cmd, "help") == 0) {
-        kprint("%bhelp%_                %mShow this help.%_\n");
-        kprint("%bharts%_               %mPrint the status of each HART.%_\n");
-        kprint("%bmap%_                 %mShow a memory map.%_\n");
-        kprint("%blspci%_               %mList PCI devices.%_\n");
-        kprint("%brand%_ %gN%_              %mGenerate %gN%m random bytes and hex dump them.%_\n");
-        kprint("%bfault%_               %mCause a page fault.%_\n");
-        kprint("%bdisplay-reset%_       %mReset the display if the GPU is active.%_\n");
-        kprint("%bprocs%_               %mShow scheduling information in an updating table.%_\n");
-        kprint("%bcd%_ %g[PATH]%_           %mChange the current working directory to '/' or %gPATH%m if provided.%_\n");
-        kprint("%bls%_ %g[PATH]%_           %mShow the contents of the current directory or %gPATH%m if provided.%_\n");
-        kprint("%btree%_ %g[PATH]%_         %mShow a tree view of the current directory or %gPATH%m if provided.%_\n");
-        kprint("%bcat%_ %gPATH%_            %mPrint the contents of the file at %gPATH%m.%_\n");
-        kprint("%bhexcat%_ %gPATH%_         %mHexdump the contents of the file at %gPATH%m.%_\n");
-        kprint("%bappend%_ %gPATH%_ %gSTRING%_  %mAppend %gSTRING%m to the file at %gPATH%m, creating it if it does not exist.%_\n");
-        kprint("%brun%_ %gPATH%_            %mRun the ELF file at %gPATH%m.%_\n");
+        kprint("%bhelp%_                    %mShow this help.%_\n");
+        kprint("%bharts%_                   %mPrint the status of each HART.%_\n");
+        kprint("%bmap%_                     %mShow a memory map.%_\n");
+        kprint("%blspci%_                   %mList PCI devices.%_\n");
+        kprint("%brand%_ %gN%_                  %mGenerate %gN%m random bytes and hex dump them.%_\n");
+        kprint("%bfault%_                   %mCause a page fault.%_\n");
+        kprint("%bdisplay-reset%_           %mReset the display if the GPU is active.%_\n");
+        kprint("%bframes%_                  %mShow GPU frame clock statistics.%_\n");
+        kprint("%bprocs%_                   %mShow scheduling information in an updating table.%_\n");
+        kprint("%bcd%_ %g[PATH]%_               %mChange the current working directory to '/' or %gPATH%m if provided.%_\n");
+        kprint("%bls%_ %g[PATH]%_               %mShow the contents of the current directory or %gPATH%m if provided.%_\n");
+        kprint("%btree%_ %g[PATH]%_             %mShow a tree view of the current directory or %gPATH%m if provided.%_\n");
+        kprint("%bcat%_ %gPATH%_                %mPrint the contents of the file at %gPATH%m.%_\n");
+        kprint("%bhexcat%_ %gPATH%_             %mHexdump the contents of the file at %gPATH%m.%_\n");
+        kprint("%bappend%_ %gPATH%_ %gSTRING%_      %mAppend %gSTRING%m to the file at %gPATH%m, creating it if it does not exist.%_\n");
+        kprint("%brun%_ %gPATH%_                %mRun the ELF file at %gPATH%m.%_\n");
+        kprint("%bblkpoll%_ %g[N CYCLES]%_      %mList block devices, or spin up to %gCYCLES%m for completions on device %gN%m (0 = IRQ only).%_\n");
+        kprint("%bblkdeadline%_ %g[N CYCLES]%_  %mList block devices, or hold requests on device %gN%m up to %gCYCLES%m for merging.%_\n");
     } else {
         kprint("%runknown command '%s'%_\n", cmd);
     }
@@ -128,6 +128,39 @@ out:;
     return mapped;
 }
 
+void mmu_unmap(Page_Table *pt, u64 vaddr, u64 size) {
+    Page_Table *pt_save;
+    u64         vpn[3];
+    u64         pte;
+    s32         level;
+
+    pt_save = pt;
+
+    spin_lock(&kernel_pt_lock);
+
+    for (; size >= PAGE_SIZE; size -= PAGE_SIZE, vaddr += PAGE_SIZE) {
+        pt = pt_save;
+
+        vpn[0] = (vaddr >> ADDR_0_BIT) & 0x1FFULL;
+        vpn[1] = (vaddr >> ADDR_1_BIT) & 0x1FFULL;
+        vpn[2] = (vaddr >> ADDR_2_BIT) & 0x1FFULL;
+
+        for (level = 2; level >= 1; level -= 1) {
+            pte = pt->entries[vpn[level]];
+            if (!(pte & PAGE_VALID) || !PTE_IS_BRANCH(pte)) { break; }
+            pt = PTE_BRANCH_TO_PT(pte);
+        }
+
+        if (level == 0) {
+            pt->entries[vpn[0]] = 0;
+        }
+    }
+
+    spin_unlock(&kernel_pt_lock);
+
+    SFENCE();
+}
+
 void free_page_table(Page_Table *pt) {
     u32 e;
     u64 pte;
@@ -7,6 +7,7 @@
 #include "kmalloc.h"
 #include "lock.h"
 #include "utils.h"
+#include "gpu.h"
 
 void trap_jump(void);
 
@@ -131,6 +132,34 @@ found:;
     return proc;
 }
 
+/*
+ * Gives back what the process holds outside of its own memory. Closing files
+ * and windows can block on I/O, so this must not be called with a scheduler
+ * lock held.
+ */
+void release_process(Process *proc) {
+    u32 fd;
+
+    for (fd = 0; fd < MAX_FDS; fd += 1) {
+        if (proc->fds[fd] != NULL) {
+            file_release(proc->fds[fd]->file);
+            kfree(proc->fds[fd]);
+            proc->fds[fd] = NULL;
+        }
+    }
+
+    if (proc->ring != NULL) {
+        free_pages(proc->ring->hdr);
+        array_free(proc->ring->parked);
+        kfree(proc->ring);
+        proc->ring = NULL;
+    }
+
+    if (proc->kind == PROC_USER) {
+        gpu_release_process(proc);
+    }
+}
+
 void free_process(Process *proc) {
     if (proc->kind == PROC_USER) {
         free_pages(proc->page_table);
@@ -198,6 +198,8 @@ void sched_exit_current(s64 exit_code) {
         return;
     }
 
+    release_process(sched->current);
+
     spin_lock(&sched->lock);
 
     free_process(sched->current);
@@ -10,6 +10,9 @@
 #include "mmu.h"
 #include "vfs.h"
 #include "page.h"
+#include "kmalloc.h"
+#include "utils.h"
+#include "tick.h"
 
 s64 handle_SYS_EXIT(s64 exit_code) {
     sched_exit_current(exit_code);
@@ -59,7 +62,66 @@ s64 handle_SYS_GET_PID(void) {
     return 0;
 }
 
+/* Sleeps for n_cycles and then runs the ecall again as syscall sys. Does not return. */
+static void sleep_and_restart(u64 sys, u64 n_cycles) {
+    u64            sscratch;
+    Process_Frame *frame;
+    u64            sepc;
+    u32            hart;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    CSR_READ(sepc, "sepc");
+
+    frame->sepc            = sepc - 4;
+    frame->gpregs[XREG_A0] = sys;
+
+    CSR_WRITE("sepc", sepc - 4);
+
+    hart = sbicall(SBI_HART_ID);
+
+    tick_within(hart, n_cycles);
+    sched_sleep_current(n_cycles);
+}
+
+/*
+ * A commit coalesced into a frame that has already presented waits for a
+ * later commit or frame wait. A process that is about to block may never
+ * make one, so it presents the deferred commits first. If their frame hasn't
+ * started yet, it sleeps until it does and restarts as sys.
+ */
+static void present_before_blocking(u64 sys) {
+    u64 left;
+
+    if (!gpu_frame_pending(&left)) { return; }
+
+    if (left > 0) {
+        sleep_and_restart(sys, left);
+    }
+
+    gpu_frame_flush();
+}
+
 s64 handle_SYS_SLEEP(u64 n_ticks) {
+    u64            sscratch;
+    Process_Frame *frame;
+    u64            left;
+
+    if (gpu_frame_pending(&left) && left < n_ticks) {
+        if (left > 0) {
+            CSR_READ(sscratch, "sscratch");
+            frame = (void*)sscratch;
+
+            /* Sleep what remains after the frame starts. */
+            frame->gpregs[XREG_A1] = n_ticks - left;
+
+            sleep_and_restart(SYS_SLEEP, left);
+        }
+
+        gpu_frame_flush();
+    }
+
     sched_sleep_current(n_ticks);
     return 0;
 }
@@ -67,6 +129,8 @@ s64 handle_SYS_SLEEP(u64 n_ticks) {
 s64 handle_SYS_INPUT_POLL(void) {
     if (input_ready()) { return 0; }
 
+    present_before_blocking(SYS_INPUT_POLL);
+
     sched_wait_current(PROC_WAIT_INPUT);
 
     return 0;
@@ -97,13 +161,13 @@ s64 handle_SYS_GPU_GET_CTX(void) {
     CSR_READ(sscratch, "sscratch");
     frame = (void*)sscratch;
 
-    frame->gpregs[XREG_A0] = gpu_ctx();
+    frame->gpregs[XREG_A0] = gpu_ctx(sched_current(sbicall(SBI_HART_ID)));
 
     return 0;
 }
 
 s64 handle_SYS_GPU_REL_CTX(s64 ctx) {
-    gpu_ctx_release(ctx);
+    gpu_ctx_release(ctx, sched_current(sbicall(SBI_HART_ID)));
     return 0;
 }
 
@@ -114,7 +178,7 @@ s64 handle_SYS_GPU_CTX_PIXELS(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 *upixels)
 
     user_to_kernel(pixels, upixels, w * h * sizeof(u32));
 
-    gpu_ctx_pixels(ctx, x, y, w, h, pixels);
+    gpu_ctx_pixels(ctx, sched_current(sbicall(SBI_HART_ID)), x, y, w, h, pixels);
 
     kfree(pixels);
 
@@ -122,7 +186,7 @@ s64 handle_SYS_GPU_CTX_PIXELS(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 *upixels)
 }
 
 s64 handle_SYS_GPU_CTX_RECT(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 rgba_color) {
-    gpu_ctx_rect(ctx, x, y, w, h, rgba_color);
+    gpu_ctx_rect(ctx, sched_current(sbicall(SBI_HART_ID)), x, y, w, h, rgba_color);
 
     return 0;
 }
@@ -144,12 +208,106 @@ s64 handle_SYS_GPU_CTX_GET_RECT(s64 ctx, u32 *ux, u32 *uy, u32 *uw, u32 *uh) {
 }
 
 s64 handle_SYS_GPU_COMMIT(s64 ctx) {
-    gpu_ctx_commit(ctx);
+    gpu_ctx_commit(ctx, sched_current(sbicall(SBI_HART_ID)));
     return 0;
 }
 
 s64 handle_SYS_GPU_CLEAR(s64 ctx, u32 rgba_color) {
-    gpu_ctx_clear(ctx, rgba_color);
+    gpu_ctx_clear(ctx, sched_current(sbicall(SBI_HART_ID)), rgba_color);
+    return 0;
+}
+
+s64 handle_SYS_GPU_MAP_CTX(s64 ctx, u32 *uw, u32 *uh) {
+    u64            sscratch;
+    Process_Frame *frame;
+    u64            vaddr;
+    u32            w;
+    u32            h;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    if ((vaddr = gpu_ctx_map(ctx, sched_current(sbicall(SBI_HART_ID)), &w, &h)) == 0) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    kernel_to_user(uw, &w, sizeof(*uw));
+    kernel_to_user(uh, &h, sizeof(*uh));
+
+    frame->gpregs[XREG_A0] = vaddr;
+
+    return 0;
+}
+
+s64 handle_SYS_GPU_SET_CURSOR(u32 *upixels, u32 hot_x, u32 hot_y) {
+    u64            sscratch;
+    Process_Frame *frame;
+    u32           *pixels;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    pixels = kmalloc(4 * GPU_CURSOR_SIZE * GPU_CURSOR_SIZE);
+
+    user_to_kernel(pixels, upixels, 4 * GPU_CURSOR_SIZE * GPU_CURSOR_SIZE);
+
+    frame->gpregs[XREG_A0] = gpu_set_cursor(pixels, hot_x, hot_y);
+
+    kfree(pixels);
+
+    return 0;
+}
+
+s64 handle_SYS_GPU_MOVE_CURSOR(s64 ctx, u32 x, u32 y) {
+    u64            sscratch;
+    Process_Frame *frame;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    frame->gpregs[XREG_A0] = gpu_ctx_move_cursor(ctx, sched_current(sbicall(SBI_HART_ID)), x, y);
+
+    return 0;
+}
+
+/*
+ * Sleeps until the next frame starts, presents anything committed since the
+ * last present and returns the new frame's number. The process is woken by a
+ * tick brought forward to the frame boundary and re-enters to check it.
+ */
+s64 handle_SYS_GPU_WAIT_FRAME(GPU_Frame_Stats *ustats) {
+    u64              sscratch;
+    Process_Frame   *frame;
+    Process         *current;
+    GPU_Frame_Stats  stats;
+    u64              left;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    current = sched_current(sbicall(SBI_HART_ID));
+
+    if (current->frame_wait == 0) {
+        current->frame_wait = gpu_frame_now() + 1;
+    }
+
+    if ((left = gpu_frame_until(current->frame_wait)) > 0) {
+        sleep_and_restart(SYS_GPU_WAIT_FRAME, left);
+    }
+
+    current->frame_wait = 0;
+
+    gpu_frame_flush();
+
+    gpu_frame_stats(&stats);
+
+    if (ustats != NULL) {
+        kernel_to_user(ustats, &stats, sizeof(stats));
+    }
+
+    frame->gpregs[XREG_A0] = stats.frame;
+
     return 0;
 }
 
@@ -158,13 +316,15 @@ s64 handle_SYS_FILE_SIZE(const char *upath) {
     Process_Frame *frame;
     char           path[256];
     File          *f;
+    Process       *current;
 
     CSR_READ(sscratch, "sscratch");
     frame = (void*)sscratch;
 
     user_to_kernel(path, upath, sizeof(path));
 
-    f = get_file(path);
+    current = sched_current(sbicall(SBI_HART_ID));
+    f       = get_file_cached(&current->path_cache, path);
 
     if (f == NULL) {
         frame->gpregs[XREG_A0] = -1;
@@ -202,6 +362,7 @@ s64 handle_SYS_FILE_READ(const char *upath, u8 *udst, u64 offset, u64 n_bytes) {
     Process_Frame *frame;
     char           path[256];
     File          *f;
+    Process       *current;
     u8            *buff;
 
     CSR_READ(sscratch, "sscratch");
@@ -209,7 +370,8 @@ s64 handle_SYS_FILE_READ(const char *upath, u8 *udst, u64 offset, u64 n_bytes) {
 
     user_to_kernel(path, upath, sizeof(path));
 
-    f = get_file(path);
+    current = sched_current(sbicall(SBI_HART_ID));
+    f       = get_file_cached(&current->path_cache, path);
 
     if (f == NULL) {
         frame->gpregs[XREG_A0] = -1;
@@ -223,8 +385,536 @@ s64 handle_SYS_FILE_READ(const char *upath, u8 *udst, u64 offset, u64 n_bytes) {
     return 0;
 }
 
+static Open_File *get_open_file(Process *proc, s64 fd) {
+    if (proc == NULL || fd < 0 || fd >= MAX_FDS) { return NULL; }
+
+    return proc->fds[fd];
+}
+
+/*
+ * Vectored I/O goes through the FS in large contiguous pieces: up to
+ * IOV_CHUNK bytes of the segments are gathered into (or scattered out of) one
+ * kernel buffer per FS call, so the FS maps each range once and the block
+ * queue sees runs of requests it can merge, rather than one syscall's worth
+ * per segment. The FS only writes to kernel addresses, so some buffer is
+ * needed either way; a fixed one keeps the user from picking its size.
+ * Plain reads go the same way as a single segment.
+ */
+#define IOV_CHUNK (KB(128))
+
+typedef struct {
+    IO_Vec *iov;
+    u64     n_iov;
+    u64     i;
+    u64     off; /* Into iov[i]. */
+} IOV_Cursor;
+
+static s64 copy_in_iovecs(const IO_Vec *uiov, u64 n_iov, IO_Vec *iov, u64 *total) {
+    u64 i;
+
+    if (n_iov > IOV_MAX) { return -1; }
+
+    user_to_kernel(iov, uiov, n_iov * sizeof(IO_Vec));
+
+    /* The result has to fit in an s64. */
+    *total = 0;
+    for (i = 0; i < n_iov; i += 1) {
+        if (iov[i].len > ((u64)-1 >> 1) - *total) { return -1; }
+        *total += iov[i].len;
+    }
+
+    return 0;
+}
+
+/* Copies n bytes between buff and the segments at the cursor, advancing it. */
+static void iov_copy(IOV_Cursor *cur, u8 *buff, u64 n, u32 to_user) {
+    u64 len;
+
+    while (n > 0 && cur->i < cur->n_iov) {
+        len = MIN(cur->iov[cur->i].len - cur->off, n);
+
+        if (to_user) {
+            kernel_to_user((u8*)cur->iov[cur->i].base + cur->off, buff, len);
+        } else {
+            user_to_kernel(buff, (u8*)cur->iov[cur->i].base + cur->off, len);
+        }
+
+        buff     += len;
+        n        -= len;
+        cur->off += len;
+
+        if (cur->off == cur->iov[cur->i].len) {
+            cur->i   += 1;
+            cur->off  = 0;
+        }
+    }
+}
+
+/*
+ * iov is in kernel memory and its lengths add up to total. Returns the number
+ * of bytes transferred, or -1 if nothing was.
+ */
+static s64 rw_chunked(Open_File *of, IO_Vec *iov, u64 n_iov, u64 total, u64 offset, u32 write) {
+    IOV_Cursor  cur;
+    u64         done;
+    u64         want;
+    u8         *buff;
+    s64         n;
+
+    if (total == 0) { return 0; }
+
+    cur.iov   = iov;
+    cur.n_iov = n_iov;
+    cur.i     = 0;
+    cur.off   = 0;
+
+    if ((buff = kmalloc(MIN(total, IOV_CHUNK))) == NULL) { return -1; }
+
+    done = 0;
+
+    while (done < total) {
+        want = MIN(total - done, IOV_CHUNK);
+
+        if (write) {
+            iov_copy(&cur, buff, want, 0);
+            n = file_write(of->file, buff, offset + done, want);
+        } else {
+            n = file_read(of->file, buff, offset + done, want);
+            if (n > 0) {
+                iov_copy(&cur, buff, n, 1);
+            }
+        }
+
+        if (n <= 0) {
+            if (done == 0) { done = n; }
+            break;
+        }
+
+        done += n;
+
+        if ((u64)n < want) { break; }
+    }
+
+    kfree(buff);
+
+    return done;
+}
+
+static s64 rw_iovecs(Open_File *of, const IO_Vec *uiov, u64 n_iov, u64 offset, u32 write) {
+    IO_Vec iov[IOV_MAX];
+    u64    total;
+
+    if (copy_in_iovecs(uiov, n_iov, iov, &total) != 0) { return -1; }
+
+    return rw_chunked(of, iov, n_iov, total, offset, write);
+}
+
+/* Returns the number of bytes read, or -1. */
+static s64 read_open_file(Open_File *of, u8 *udst, u64 offset, u64 n_bytes) {
+    IO_Vec iov;
+
+    /* The result has to fit in an s64. */
+    if (n_bytes > ((u64)-1 >> 1)) { return -1; }
+
+    iov.base = udst;
+    iov.len  = n_bytes;
+
+    return rw_chunked(of, &iov, 1, n_bytes, offset, 0);
+}
+
+static s64 readv_open_file(Open_File *of, const IO_Vec *uiov, u64 n_iov, u64 offset) {
+    return rw_iovecs(of, uiov, n_iov, offset, 0);
+}
+
+s64 handle_SYS_OPEN(const char *upath) {
+    u64            sscratch;
+    Process_Frame *frame;
+    char           path[256];
+    File          *f;
+    Process       *current;
+    s64            fd;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    frame->gpregs[XREG_A0] = -1;
+
+    user_to_kernel(path, upath, sizeof(path));
+
+    current = sched_current(sbicall(SBI_HART_ID));
+    f       = get_file_cached(&current->path_cache, path);
+
+    if (f == NULL || f->kind != FILE_REGULAR) { return 0; }
+
+    for (fd = 0; fd < MAX_FDS; fd += 1) {
+        if (current->fds[fd] == NULL) { break; }
+    }
+
+    if (fd == MAX_FDS)       { return 0; }
+    if (file_open(f) != 0)   { return 0; }
+
+    current->fds[fd]         = kmalloc(sizeof(Open_File));
+    current->fds[fd]->file   = f;
+    current->fds[fd]->offset = 0;
+
+    frame->gpregs[XREG_A0] = fd;
+
+    return 0;
+}
+
+s64 handle_SYS_READ(s64 fd, u8 *udst, u64 n_bytes) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+    s64            n_read;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    n_read = read_open_file(of, udst, of->offset, n_bytes);
+
+    if (n_read > 0) {
+        of->offset += n_read;
+    }
+
+    frame->gpregs[XREG_A0] = n_read;
+
+    return 0;
+}
+
+s64 handle_SYS_PREAD(s64 fd, u8 *udst, u64 n_bytes, u64 offset) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    frame->gpregs[XREG_A0] = read_open_file(of, udst, offset, n_bytes);
+
+    return 0;
+}
+
+s64 handle_SYS_SEEK(s64 fd, s64 offset, u32 whence) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+    s64            base;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    frame->gpregs[XREG_A0] = -1;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) { return 0; }
+
+    switch (whence) {
+        case SEEK_SET: base = 0;                   break;
+        case SEEK_CUR: base = of->offset;          break;
+        case SEEK_END: base = file_size(of->file); break;
+        default:       return 0;
+    }
+
+    if (base < 0 || base + offset < 0) { return 0; }
+
+    of->offset             = base + offset;
+    frame->gpregs[XREG_A0] = of->offset;
+
+    return 0;
+}
+
+s64 handle_SYS_CLOSE(s64 fd) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Process       *current;
+    Open_File     *of;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    current = sched_current(sbicall(SBI_HART_ID));
+
+    if ((of = get_open_file(current, fd)) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    file_release(of->file);
+    kfree(of);
+    current->fds[fd] = NULL;
+
+    frame->gpregs[XREG_A0] = 0;
+
+    return 0;
+}
+
+s64 handle_SYS_READV(s64 fd, const IO_Vec *uiov, u64 n_iov) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+    s64            n_read;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    n_read = readv_open_file(of, uiov, n_iov, of->offset);
+
+    if (n_read > 0) {
+        of->offset += n_read;
+    }
+
+    frame->gpregs[XREG_A0] = n_read;
+
+    return 0;
+}
+
+s64 handle_SYS_PREADV(s64 fd, const IO_Vec *uiov, u64 n_iov, u64 offset) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    frame->gpregs[XREG_A0] = readv_open_file(of, uiov, n_iov, offset);
+
+    return 0;
+}
+
+s64 handle_SYS_WRITEV(s64 fd, const IO_Vec *uiov, u64 n_iov) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Open_File     *of;
+    s64            n_written;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    frame->gpregs[XREG_A0] = -1;
+
+    if ((of = get_open_file(sched_current(sbicall(SBI_HART_ID)), fd)) == NULL) { return 0; }
+
+    n_written = rw_iovecs(of, uiov, n_iov, of->offset, 1);
+
+    if (n_written > 0) {
+        of->offset += n_written;
+    }
+
+    frame->gpregs[XREG_A0] = n_written;
+
+    return 0;
+}
+
 typedef s64 (*syscall_handler_t)();
 
+extern syscall_handler_t syscall_handlers[NUM_SYSCALL];
+
+s64 handle_SYS_RING_SETUP(u64 n_entries) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Process       *current;
+    Syscall_Ring  *ring;
+    u64            size;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    frame->gpregs[XREG_A0] = -1;
+
+    current = sched_current(sbicall(SBI_HART_ID));
+
+    if (current->ring != NULL
+    ||  n_entries == 0
+    ||  n_entries > RING_MAX_ENTRIES
+    ||  next_power_of_2(n_entries) != n_entries) {
+        return 0;
+    }
+
+    size = ALIGN(RING_SIZE(n_entries), PAGE_SIZE);
+
+    ring            = kmalloc(sizeof(*ring));
+    ring->hdr       = alloc_pages(size / PAGE_SIZE);
+    ring->n_entries = n_entries;
+    ring->parked    = array_make(Ring_SQE);
+
+    memset(ring->hdr, 0, size);
+    ring->hdr->n_entries = n_entries;
+
+    mmu_map(current->page_table, (u64)ring->hdr, current->virt_avail, size, PAGE_READ | PAGE_WRITE | PAGE_USER);
+
+    current->ring          = ring;
+    frame->gpregs[XREG_A0] = current->virt_avail;
+
+    current->virt_avail += size;
+
+    return 0;
+}
+
+/* Anything that can deschedule the caller or that manages the ring itself has to go through a real trap. */
+static s64 ring_call_allowed(u32 call) {
+    switch (call) {
+        case SYS_EXIT:
+        case SYS_SLEEP:
+        case SYS_GPU_WAIT_FRAME:
+        case SYS_INPUT_POLL:
+        case SYS_RING_SETUP:
+        case SYS_RING_ENTER:
+            return 0;
+    }
+
+    return call < NUM_SYSCALL;
+}
+
+/* Handlers report through a0 like they would for a real ecall. */
+static s64 ring_call(Process_Frame *frame, Ring_SQE *sqe) {
+    if (!ring_call_allowed(sqe->call)) { return -1; }
+
+    frame->gpregs[XREG_A0] = 0;
+
+    if (syscall_handlers[sqe->call](sqe->args[0], sqe->args[1], sqe->args[2],
+                                    sqe->args[3], sqe->args[4], sqe->args[5]) != 0) {
+        return -1;
+    }
+
+    return frame->gpregs[XREG_A0];
+}
+
+/* Not RING_SQ()/RING_CQ(): the n_entries in the shared header can't be trusted. */
+static Ring_SQE *ring_sqe(Syscall_Ring *ring, u32 idx) {
+    return (Ring_SQE*)((u8*)ring->hdr + sizeof(Ring_Header)) + (idx & (ring->n_entries - 1));
+}
+
+static Ring_CQE *ring_cqe(Syscall_Ring *ring, u32 idx) {
+    return (Ring_CQE*)ring_sqe(ring, ring->n_entries) + (idx & (2 * ring->n_entries - 1));
+}
+
+static u32 ring_cq_space(Syscall_Ring *ring) {
+    u32 used;
+
+    used = ring->hdr->cq_tail - ring->hdr->cq_head + array_len(ring->parked);
+
+    return used >= 2 * ring->n_entries ? 0 : 2 * ring->n_entries - used;
+}
+
+static void ring_complete(Syscall_Ring *ring, Ring_SQE *sqe, s64 result) {
+    Ring_CQE *cqe;
+    u32       tail;
+
+    tail           = ring->hdr->cq_tail;
+    cqe            = ring_cqe(ring, tail);
+    cqe->user_data = sqe->user_data;
+    cqe->result    = result;
+
+    MEMORY_FENCE();
+    ring->hdr->cq_tail = tail + 1;
+}
+
+/*
+ * Entries run in order and complete before SYS_RING_ENTER returns, except for
+ * RING_SQE_WAIT input pops, which park in the kernel until there is an event.
+ * If min_complete can't be met yet and something is parked, the process waits
+ * for input and then re-enters with nothing new to submit.
+ */
+s64 handle_SYS_RING_ENTER(u64 to_submit, u64 min_complete) {
+    u64            sscratch;
+    Process_Frame *frame;
+    Process       *current;
+    Syscall_Ring  *ring;
+    Ring_SQE       sqe;
+    Ring_SQE      *parked;
+    s64            result;
+    u32            head;
+    u32            i;
+    u64            sepc;
+
+    CSR_READ(sscratch, "sscratch");
+    frame = (void*)sscratch;
+
+    CSR_READ(sepc, "sepc");
+
+    current = sched_current(sbicall(SBI_HART_ID));
+
+    if ((ring = current->ring) == NULL) {
+        frame->gpregs[XREG_A0] = -1;
+        return 0;
+    }
+
+    /* Parked entries already hold their completion slot (see ring_cq_space()). */
+    for (i = 0; i < array_len(ring->parked);) {
+        parked = array_item(ring->parked, i);
+
+        if ((result = ring_call(frame, parked)) == -1) {
+            i += 1;
+            continue;
+        }
+
+        sqe = *parked;
+        array_delete(ring->parked, i);
+        ring_complete(ring, &sqe, result);
+    }
+
+    head = ring->hdr->sq_head;
+
+    MEMORY_FENCE();
+
+    for (; to_submit > 0 && head != ring->hdr->sq_tail; to_submit -= 1) {
+        if (ring_cq_space(ring) == 0) { break; }
+
+        /* Copy it out first so the process can't change it under us. */
+        memcpy(&sqe, ring_sqe(ring, head), sizeof(sqe));
+        head += 1;
+
+        result = ring_call(frame, &sqe);
+
+        if (result == -1 && sqe.call == SYS_INPUT_POP && (sqe.flags & RING_SQE_WAIT)) {
+            array_push(ring->parked, sqe);
+        } else {
+            ring_complete(ring, &sqe, result);
+        }
+    }
+
+    ring->hdr->sq_head = head;
+
+    if (ring->hdr->cq_tail - ring->hdr->cq_head < min_complete
+    &&  array_len(ring->parked) > 0
+    &&  !input_ready()) {
+
+        /* Restart the ecall once woken. */
+        frame->sepc            = sepc - 4;
+        frame->gpregs[XREG_A0] = SYS_RING_ENTER;
+        frame->gpregs[XREG_A1] = 0;
+        frame->gpregs[XREG_A2] = min_complete;
+
+        CSR_WRITE("sepc", sepc - 4);
+
+        sched_wait_current(PROC_WAIT_INPUT);
+    }
+
+    frame->gpregs[XREG_A0] = ring->hdr->cq_tail - ring->hdr->cq_head;
+
+    return 0;
+}
+
 #define SYSCALL_FN(s, d) (syscall_handler_t)handle_##s,
 syscall_handler_t syscall_handlers[NUM_SYSCALL] = {
     LIST_SYSCALL(SYSCALL_FN)
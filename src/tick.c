@@ -2,7 +2,10 @@
 #include "sbi.h"
 #include "sched.h"
 
+static u64 next_tick[MAX_HARTS];
+
 static void set_next_tick(u32 hart) {
+    next_tick[hart] = sbicall(SBI_CLOCK) + DEFAULT_TICK;
     sbicall(SBI_TIMER_REL, hart, DEFAULT_TICK);
 }
 
@@ -18,6 +21,18 @@ void force_tick(u32 hart) {
     sbicall(SBI_TIMER_REL, hart, 0);
 }
 
+/* Brings the next tick forward so it comes no later than n_cycles from now. */
+void tick_within(u32 hart, u64 n_cycles) {
+    u64 when;
+
+    when = sbicall(SBI_CLOCK) + n_cycles;
+
+    if (when < next_tick[hart]) {
+        next_tick[hart] = when;
+        sbicall(SBI_TIMER_REL, hart, n_cycles);
+    }
+}
+
 s64 do_tick(u32 hartid) {
     set_next_tick(hartid);
     sched_tick(hartid);
@@ -20,6 +20,16 @@ s64 strcmp(const char *a, const char *b) {
     return diff;
 }
 
+s64 strncmp(const char *a, const char *b, u64 n) {
+    s64 diff;
+
+    if (n == 0) { return 0; }
+
+    while ((diff = *a - *b) == 0 && *a != 0 && n > 1) { a += 1; b += 1; n -= 1; }
+
+    return diff;
+}
+
 void strcpy(char *dst, const char *src) {
     memcpy(dst, src, strlen(src) + 1);
 }
@@ -61,10 +71,24 @@ void memset(void *dst, int c, u64 n) {
 }
 
 void memcpy(void *dst, const void *src, u64 n) {
-    u64 i;
-    for (i = 0; i < n; i += 1) {
-        *((u8*)dst + i) = *((u8*)src +i);
+    u8       *d;
+    const u8 *s;
+
+    d = dst;
+    s = src;
+
+    /* Words at a time if both can reach 8-byte alignment together. */
+    if (((u64)d & 7) == ((u64)s & 7)) {
+        for (; n > 0 && !IS_ALIGNED(d, 8); n -= 1) { *d++ = *s++; }
+
+        for (; n >= 8; n -= 8) {
+            *(u64*)d  = *(const u64*)s;
+            d        += 8;
+            s        += 8;
+        }
     }
+
+    for (; n > 0; n -= 1) { *d++ = *s++; }
 }
 
 void memmove(void *dst, const void *src, u64 n) {
@@ -4,6 +4,7 @@
 #include "kprint.h"
 #include "driver.h"
 #include "blk.h"
+#include "lock.h"
 #include "utils.h"
 
 void fs_minix3(void);
@@ -13,18 +14,145 @@ static File *root;
 
 static FS_Impl *fs_impls[NUM_FS];
 
+/*
+ * Dentry cache: every File that has a parent is also linked into a hash table
+ * keyed by (parent, name), so resolving a path component doesn't have to scan
+ * the parent's dir_entries.
+ */
+
+#define DCACHE_MIN_BUCKETS (256)
+
+static File     **dcache;
+static u64        dcache_n_buckets;
+static u64        dcache_n_entries;
+static Spinlock   dcache_lock;
+static u64        dcache_generation; /* Bumped whenever a File goes away, to invalidate Path_Caches. */
+static Spinlock   open_lock;
+
+static u64 name_hash(const char *name) {
+    u64 h;
+
+    h = 0xcbf29ce484222325ULL;
+
+    while (*name) {
+        h ^= (u8)*name;
+        h *= 0x100000001b3ULL;
+        name += 1;
+    }
+
+    return h;
+}
+
+static u64 dcache_bucket(File *parent, u64 hash, u64 n_buckets) {
+    return (hash ^ (((u64)parent >> 4) * 0x9e3779b97f4a7c15ULL)) & (n_buckets - 1);
+}
+
+static void dcache_grow(void) {
+    File **new;
+    u64    n_buckets;
+    u64    i;
+    File  *f;
+    File  *next;
+    u64    b;
+
+    n_buckets = dcache_n_buckets ? 2 * dcache_n_buckets : DCACHE_MIN_BUCKETS;
+    new       = kmalloc(n_buckets * sizeof(File*));
+    memset(new, 0, n_buckets * sizeof(File*));
+
+    for (i = 0; i < dcache_n_buckets; i += 1) {
+        for (f = dcache[i]; f != NULL; f = next) {
+            next         = f->hash_next;
+            b            = dcache_bucket(f->parent, f->name_hash, n_buckets);
+            f->hash_next = new[b];
+            new[b]       = f;
+        }
+    }
+
+    if (dcache != NULL) { kfree(dcache); }
+
+    dcache           = new;
+    dcache_n_buckets = n_buckets;
+}
+
+static void dcache_insert(File *f) {
+    u64 b;
+
+    spin_lock(&dcache_lock);
+
+    if (dcache_n_entries >= dcache_n_buckets) { dcache_grow(); }
+
+    f->name_hash = name_hash(f->name);
+    b            = dcache_bucket(f->parent, f->name_hash, dcache_n_buckets);
+    f->hash_next = dcache[b];
+    dcache[b]    = f;
+
+    dcache_n_entries += 1;
+
+    spin_unlock(&dcache_lock);
+}
+
+static void dcache_remove(File *f) {
+    File **link;
+
+    spin_lock(&dcache_lock);
+
+    for (link = &dcache[dcache_bucket(f->parent, f->name_hash, dcache_n_buckets)];
+         *link != NULL;
+         link = &(*link)->hash_next) {
+
+        if (*link == f) {
+            *link             = f->hash_next;
+            dcache_n_entries -= 1;
+            break;
+        }
+    }
+
+    dcache_generation += 1;
+
+    spin_unlock(&dcache_lock);
+}
+
+static File *dcache_lookup(File *dir, const char *name) {
+    u64   hash;
+    File *f;
+
+    hash = name_hash(name);
+
+    spin_lock(&dcache_lock);
+
+    if (dcache == NULL) {
+        spin_unlock(&dcache_lock);
+        return NULL;
+    }
+
+    for (f = dcache[dcache_bucket(dir, hash, dcache_n_buckets)]; f != NULL; f = f->hash_next) {
+        if (f->parent == dir && f->name_hash == hash && strcmp(f->name, name) == 0) {
+            break;
+        }
+    }
+
+    spin_unlock(&dcache_lock);
+
+    return f;
+}
+
 File *vfs_new_file(const char *name, u32 kind, u32 adid) {
     File *new;
 
     new = kmalloc(sizeof(*new));
 
-    new->parent = NULL;
-    new->adid   = adid;
+    new->parent    = NULL;
+    new->adid      = adid;
+    new->hash_next = NULL;
 
     new->name[0] = 0;
     strcpy(new->name, name);
 
-    new->kind = kind;
+    new->kind       = kind;
+    new->populated  = 1;
+    new->open_count = 0;
+    new->fs_data    = NULL;
+    memset(&new->populate_lock, 0, sizeof(new->populate_lock));
     if (new->kind == FILE_DIRECTORY) {
         new->dir_entries = array_make(File*);
     }
@@ -35,6 +163,7 @@ File *vfs_new_file(const char *name, u32 kind, u32 adid) {
 void vfs_add_dir_entry(File *dir, File *entry) {
     array_push(dir->dir_entries, entry);
     entry->parent = dir;
+    dcache_insert(entry);
 }
 
 void vfs_file_delete(File *f) {
@@ -42,13 +171,16 @@ void vfs_file_delete(File *f) {
     File **it;
 
     if (f->kind == FILE_DIRECTORY) {
-        array_traverse(f->dir_entries, it) {
-            vfs_file_delete(*it);
+        /* Each child unlinks itself from dir_entries, so always take the last one. */
+        while (array_len(f->dir_entries) > 0) {
+            vfs_file_delete(*(File**)array_item(f->dir_entries, array_len(f->dir_entries) - 1));
         }
         array_free(f->dir_entries);
     }
 
     if (f->parent != NULL) {
+        dcache_remove(f);
+
         i = 0;
         array_traverse(f->parent->dir_entries, it) {
             if ((*it) == f) {
@@ -62,6 +194,68 @@ void vfs_file_delete(File *f) {
     kfree(f);
 }
 
+/*
+ * Filesystems may hand out directories whose children haven't been read yet.
+ * They're filled in here, the first time anyone looks inside. The lock is the
+ * directory's own, so reading one directory doesn't hold up lookups anywhere
+ * else.
+ */
+void vfs_populate(File *dir) {
+    if (dir->kind != FILE_DIRECTORY || dir->populated) { return; }
+
+    spin_lock(&dir->populate_lock);
+
+    if (!dir->populated) {
+        if (dir->fs < NUM_FS
+        &&  fs_impls[dir->fs] != NULL
+        &&  fs_impls[dir->fs]->populate != NULL) {
+
+            fs_impls[dir->fs]->populate(dir);
+        }
+
+        dir->populated = 1;
+    }
+
+    spin_unlock(&dir->populate_lock);
+}
+
+/* Only looks at what's already in memory. */
+File *vfs_find_dir_entry(File *dir, const char *name) {
+    return dcache_lookup(dir, name);
+}
+
+/*
+ * Find the child of dir called name. If dir hasn't been populated and its
+ * filesystem can look up a single name (e.g. through an on-disk index), only
+ * that entry is brought in; otherwise the whole directory is.
+ */
+File *vfs_lookup_child(File *dir, const char *name) {
+    File    *f;
+    FS_Impl *impl;
+
+    if ((f = dcache_lookup(dir, name)) != NULL || dir->populated) {
+        return f;
+    }
+
+    impl = dir->fs < NUM_FS ? fs_impls[dir->fs] : NULL;
+
+    if (impl == NULL || impl->lookup == NULL) {
+        vfs_populate(dir);
+        return dcache_lookup(dir, name);
+    }
+
+    spin_lock(&dir->populate_lock);
+
+    if ((f = dcache_lookup(dir, name)) == NULL && !dir->populated) {
+        impl->lookup(dir, name);
+        f = dcache_lookup(dir, name);
+    }
+
+    spin_unlock(&dir->populate_lock);
+
+    return f;
+}
+
 static File * make_mount_point(u32 disk_number) {
     char  name[32];
     char  num_buff[16];
@@ -137,18 +331,19 @@ void fs_impl(u32 which_fs, FS_Impl fns) {
     *fs_impls[which_fs] = fns;
 }
 
-File *get_file(const char *path) {
+File *get_file_cached(Path_Cache *cache, const char *path) {
     u64    len;
     char   cpy[256];
     char  *p;
     File  *f;
     char  *k;
     char   oldk;
-    File **it;
+    File  *dir;
+    char  *dir_end;
 
     len = strlen(path);
 
-    if (len == 0 || path[0] != '/') {
+    if (len == 0 || path[0] != '/' || len >= sizeof(cpy)) {
         return NULL;
     }
 
@@ -158,9 +353,31 @@ File *get_file(const char *path) {
     p = cpy;
     f = root;
 
+    /*
+     * If the path runs through the directory that the last lookup ended in,
+     * start from there. Cached Files are only safe to use while nothing has
+     * been deleted since they were stored.
+     */
+    if (cache != NULL
+    &&  cache->dir != NULL
+    &&  cache->generation == dcache_generation
+    &&  len > cache->len
+    &&  cpy[cache->len] == '/'
+    &&  strncmp(cpy, cache->prefix, cache->len) == 0) {
+
+        p = cpy + cache->len;
+        f = cache->dir;
+    }
+
+    dir     = f;
+    dir_end = p;
+
     while (f != NULL && *p == '/') {
         if (f->kind != FILE_DIRECTORY) { return NULL; }
 
+        dir     = f;
+        dir_end = p;
+
         do { p += 1; } while (*p == '/');
         if (!*p) { break; }
 
@@ -178,23 +395,40 @@ File *get_file(const char *path) {
             goto cont;
         }
 
-        array_traverse(f->dir_entries, it) {
-            if (strcmp((*it)->name, p) == 0) {
-                f = *it;
-                goto cont;
-            }
+        if ((f = vfs_lookup_child(f, p)) == NULL) {
+            return NULL;
         }
 
-        return NULL;
-
 cont:;
         *k = oldk;
         p  = k;
     }
 
+    if (f != NULL && cache != NULL && f != root) {
+        if (f->kind == FILE_DIRECTORY) {
+            dir     = f;
+            dir_end = p;
+        }
+
+        /* Trailing slashes would make the prefix never match. */
+        while (dir_end > cpy && *(dir_end - 1) == '/') { dir_end -= 1; }
+
+        if (dir_end > cpy && dir != root) {
+            cache->len = dir_end - cpy;
+            memcpy(cache->prefix, cpy, cache->len);
+            cache->prefix[cache->len] = 0;
+            cache->dir        = dir;
+            cache->generation = dcache_generation;
+        }
+    }
+
     return f;
 }
 
+File *get_file(const char *path) {
+    return get_file_cached(NULL, path);
+}
+
 s64 get_file_path(File *file, char *buff) {
     array_t   path;
     File    **it;
@@ -255,6 +489,9 @@ s64 path_dirname(const char *path, char *buff) {
 s64 file_create(File *dir, const char *name, u32 kind) {
     if (dir->fs >= NUM_FS || fs_impls[dir->fs] == NULL) { return -1; }
 
+    /* Otherwise populating later would find the new entry on disk a second time. */
+    vfs_populate(dir);
+
     return fs_impls[dir->fs]->create(dir, name, kind);
 }
 
@@ -275,3 +512,50 @@ s64 file_size(File *file) {
 
     return fs_impls[file->fs]->size(file);
 }
+
+s64 file_sync(File *file) {
+    if (file->fs >= NUM_FS || fs_impls[file->fs] == NULL) { return -1; }
+
+    if (fs_impls[file->fs]->sync == NULL) { return 0; }
+
+    return fs_impls[file->fs]->sync(file);
+}
+
+/*
+ * The FS hears about the first open and the last release of a File so that
+ * it can keep whatever it needs to serve reads (the inode, usually) around
+ * in fs_data for as long as someone has the file open.
+ */
+s64 file_open(File *file) {
+    s64 status;
+
+    if (file->fs >= NUM_FS || fs_impls[file->fs] == NULL) { return -1; }
+
+    status = 0;
+
+    spin_lock(&open_lock);
+
+    if (file->open_count == 0 && fs_impls[file->fs]->open != NULL) {
+        status = fs_impls[file->fs]->open(file);
+    }
+
+    if (status == 0) {
+        file->open_count += 1;
+    }
+
+    spin_unlock(&open_lock);
+
+    return status;
+}
+
+void file_release(File *file) {
+    spin_lock(&open_lock);
+
+    file->open_count -= 1;
+
+    if (file->open_count == 0 && fs_impls[file->fs]->release != NULL) {
+        fs_impls[file->fs]->release(file);
+    }
+
+    spin_unlock(&open_lock);
+}
@@ -2,6 +2,9 @@
 #include "pci.h"
 #include "kmalloc.h"
 #include "kprint.h"
+#include "mmu.h"
+#include "utils.h"
+#include "machine.h"
 
 void virtio_get_device_info(VirtIO_Device_Info *info, void *pci_ecam) {
     volatile PCI_Ecam              *ecam;
@@ -58,3 +61,305 @@ void virtio_get_device_info(VirtIO_Device_Info *info, void *pci_ecam) {
         }
     }
 }
+
+u64 virtio_negotiate_features(VirtIO_Device_Info *info, u64 wanted) {
+    u64 offered;
+    u64 accepted;
+
+    info->pci_common->device_feature_select = 0;
+    offered  = info->pci_common->device_feature;
+    info->pci_common->device_feature_select = 1;
+    offered |= ((u64)info->pci_common->device_feature) << 32ULL;
+
+    accepted = offered & (wanted | VIRTIO_FEATURE(VIRTIO_F_VERSION_1));
+
+    /* A packed ring is only defined for VIRTIO 1.x devices. */
+    if (!(accepted & VIRTIO_FEATURE(VIRTIO_F_VERSION_1))) {
+        accepted &= ~VIRTIO_FEATURE(VIRTIO_F_RING_PACKED);
+    }
+
+    info->pci_common->driver_feature_select = 0;
+    info->pci_common->driver_feature        = accepted & 0xFFFFFFFF;
+    info->pci_common->driver_feature_select = 1;
+    info->pci_common->driver_feature        = accepted >> 32ULL;
+
+    info->features = accepted;
+
+    return accepted;
+}
+
+s64 virtio_queue_init(VirtIO_Device_Info *info, VirtIO_Queue *queue, u16 index) {
+    u16 size;
+    u64 notif_base;
+    u64 notif_offset;
+    u64 notif_mult;
+    u32 i;
+
+    memset(queue, 0, sizeof(*queue));
+
+    info->pci_common->queue_select = index;
+
+    size = info->pci_common->queue_size;
+
+    if (size == 0) { return -1; }
+
+    queue->index  = index;
+    queue->size   = size;
+    queue->packed = !!(info->features & VIRTIO_FEATURE(VIRTIO_F_RING_PACKED));
+
+    notif_base         = (u64)info->pci_notify_bar;
+    notif_offset       = info->pci_notify->cap.offset;
+    notif_mult         = info->pci_notify->notify_off_multiplier;
+    queue->notify_addr = (void*)(notif_base + notif_offset + info->pci_common->queue_notify_off * notif_mult);
+
+    if (queue->packed) {
+        queue->packed_ring  = kmalloc_aligned(sizeof(VirtQ_Packed_Descriptor) * size, 16);
+        memset((void*)queue->packed_ring, 0, sizeof(VirtQ_Packed_Descriptor) * size);
+        queue->driver_event = kmalloc_aligned(sizeof(VirtQ_Event_Suppress), 4);
+        memset((void*)queue->driver_event, 0, sizeof(VirtQ_Event_Suppress));
+        queue->device_event = kmalloc_aligned(sizeof(VirtQ_Event_Suppress), 4);
+        memset((void*)queue->device_event, 0, sizeof(VirtQ_Event_Suppress));
+
+        info->pci_common->queue_desc   = virt_to_phys(kernel_pt, (u64)queue->packed_ring);
+        info->pci_common->queue_driver = virt_to_phys(kernel_pt, (u64)queue->driver_event);
+        info->pci_common->queue_device = virt_to_phys(kernel_pt, (u64)queue->device_event);
+
+        queue->avail_wrap = 1;
+        queue->used_wrap  = 1;
+    } else {
+        queue->descriptor_table = kmalloc_aligned(sizeof(VirtIO_Descriptor) * size, 16);
+        memset(queue->descriptor_table, 0, sizeof(VirtIO_Descriptor) * size);
+        queue->driver_ring      = kmalloc_aligned(6 + 2 * size, 2);
+        memset((void*)queue->driver_ring, 0, 6 + 2 * size);
+        queue->device_ring      = kmalloc_aligned(6 + 8 * size, 4);
+        memset((void*)queue->device_ring, 0, 6 + 8 * size);
+
+        info->pci_common->queue_desc   = virt_to_phys(kernel_pt, (u64)queue->descriptor_table);
+        info->pci_common->queue_driver = virt_to_phys(kernel_pt, (u64)queue->driver_ring);
+        info->pci_common->queue_device = virt_to_phys(kernel_pt, (u64)queue->device_ring);
+    }
+
+    queue->free_next = kmalloc(sizeof(u16) * size);
+    queue->chain_len = kmalloc(sizeof(u16) * size);
+    queue->cookies   = kmalloc(sizeof(void*) * size);
+
+    for (i = 0; i < size; i += 1) {
+        queue->free_next[i] = (i + 1) % size;
+        queue->chain_len[i] = 0;
+        queue->cookies[i]   = NULL;
+    }
+
+    queue->free_head = 0;
+    queue->n_free    = size;
+    queue->desc_idx  = 0;
+    queue->used_idx  = 0;
+
+    info->pci_common->queue_enable = 1;
+
+    return 0;
+}
+
+/*
+ * The completion side of a queue runs from the device IRQ, which may land on
+ * the hart that is in the middle of submitting, so keep interrupts off while
+ * the queue lock is held.
+ */
+static u64 queue_lock(VirtIO_Queue *queue) {
+    u64 sstatus;
+
+    CSR_READ_CLEAR(sstatus, "sstatus", SSTATUS_SIE);
+    spin_lock(&queue->lock);
+
+    return sstatus;
+}
+
+static void queue_unlock(VirtIO_Queue *queue, u64 sstatus) {
+    spin_unlock(&queue->lock);
+
+    if (sstatus & SSTATUS_SIE) {
+        CSR_SET("sstatus", SSTATUS_SIE);
+    }
+}
+
+static u16 submit_split(VirtIO_Queue *queue, VirtIO_Buffer *bufs, u32 n_bufs) {
+    u16                head;
+    u16                idx;
+    u32                i;
+    VirtIO_Descriptor *desc;
+
+    head = idx = queue->free_head;
+
+    for (i = 0; i < n_bufs; i += 1) {
+        desc        = queue->descriptor_table + idx;
+        desc->addr  = bufs[i].addr;
+        desc->len   = bufs[i].len;
+        desc->flags = bufs[i].flags;
+        desc->next  = queue->free_next[idx];
+
+        if (i + 1 < n_bufs) {
+            desc->flags |= VIRTQ_DESC_F_NEXT;
+        }
+
+        idx = queue->free_next[idx];
+    }
+
+    queue->free_head = idx;
+
+    queue->driver_ring->ring[queue->driver_ring->idx % queue->size] = head;
+    MEMORY_FENCE();
+    queue->driver_ring->idx += 1;
+
+    return head;
+}
+
+static u16 submit_packed(VirtIO_Queue *queue, VirtIO_Buffer *bufs, u32 n_bufs) {
+    u16                               id;
+    u16                               first;
+    u16                               first_flags;
+    u16                               flags;
+    u32                               i;
+    volatile VirtQ_Packed_Descriptor *desc;
+
+    id               = queue->free_head;
+    queue->free_head = queue->free_next[id];
+
+    first       = queue->desc_idx;
+    first_flags = 0;
+
+    for (i = 0; i < n_bufs; i += 1) {
+        desc       = queue->packed_ring + queue->desc_idx;
+        desc->addr = bufs[i].addr;
+        desc->len  = bufs[i].len;
+        desc->id   = id;
+
+        flags = bufs[i].flags
+              | (i + 1 < n_bufs    ? VIRTQ_DESC_F_NEXT  : 0)
+              | (queue->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+
+        /* The head's flags are what the device polls, so they go last. */
+        if (i == 0) {
+            first_flags = flags;
+        } else {
+            desc->flags = flags;
+        }
+
+        queue->desc_idx += 1;
+        if (queue->desc_idx == queue->size) {
+            queue->desc_idx    = 0;
+            queue->avail_wrap ^= 1;
+        }
+    }
+
+    MEMORY_FENCE();
+    queue->packed_ring[first].flags = first_flags;
+
+    return id;
+}
+
+s64 virtio_queue_submit(VirtIO_Queue *queue, VirtIO_Buffer *bufs, u32 n_bufs, void *cookie) {
+    u64 sstatus;
+    u16 id;
+
+    if (n_bufs == 0 || n_bufs > queue->size) { return -1; }
+
+    sstatus = queue_lock(queue);
+
+    if (n_bufs > queue->n_free) {
+        queue_unlock(queue, sstatus);
+        return -1;
+    }
+
+    /*
+     * Either way the new buffer's ID is the current free_head. The cookie has
+     * to be in place before the device can see the buffer, or a fast
+     * completion would find nothing to hand back.
+     */
+    queue->cookies[queue->free_head]   = cookie;
+    queue->chain_len[queue->free_head] = n_bufs;
+
+    id = queue->packed
+            ? submit_packed(queue, bufs, n_bufs)
+            : submit_split(queue, bufs, n_bufs);
+
+    queue->n_free -= n_bufs;
+
+    queue_unlock(queue, sstatus);
+
+    return id;
+}
+
+void virtio_queue_notify(VirtIO_Queue *queue) {
+    MEMORY_FENCE();
+    *queue->notify_addr = queue->index;
+}
+
+void *virtio_queue_pop_used(VirtIO_Queue *queue, u32 *len) {
+    u64                               sstatus;
+    u16                               id;
+    u16                               flags;
+    u32                               used_len;
+    volatile VirtQ_Packed_Descriptor *desc;
+    u16                               last;
+    u32                               i;
+    void                             *cookie;
+
+    sstatus = queue_lock(queue);
+
+    if (queue->packed) {
+        desc  = queue->packed_ring + queue->used_idx;
+        flags = desc->flags;
+
+        if (!!(flags & VIRTQ_DESC_F_AVAIL) != !!(flags & VIRTQ_DESC_F_USED)
+        ||  !!(flags & VIRTQ_DESC_F_USED)  != queue->used_wrap) {
+
+            queue_unlock(queue, sstatus);
+            return NULL;
+        }
+
+        MEMORY_FENCE();
+
+        id       = desc->id;
+        used_len = desc->len;
+
+        queue->used_idx += queue->chain_len[id];
+        if (queue->used_idx >= queue->size) {
+            queue->used_idx  -= queue->size;
+            queue->used_wrap ^= 1;
+        }
+
+        queue->free_next[id] = queue->free_head;
+        queue->free_head     = id;
+    } else {
+        if (queue->used_idx == queue->device_ring->idx) {
+            queue_unlock(queue, sstatus);
+            return NULL;
+        }
+
+        MEMORY_FENCE();
+
+        id       = queue->device_ring->ring[queue->used_idx % queue->size].id;
+        used_len = queue->device_ring->ring[queue->used_idx % queue->size].len;
+
+        queue->used_idx += 1;
+
+        /* The chain still links through free_next, so splice it back whole. */
+        last = id;
+        for (i = 1; i < queue->chain_len[id]; i += 1) {
+            last = queue->free_next[last];
+        }
+
+        queue->free_next[last] = queue->free_head;
+        queue->free_head       = id;
+    }
+
+    queue->n_free += queue->chain_len[id];
+
+    cookie             = queue->cookies[id];
+    queue->cookies[id] = NULL;
+
+    queue_unlock(queue, sstatus);
+
+    if (len != NULL) { *len = used_len; }
+
+    return cookie;
+}
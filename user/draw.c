@@ -15,6 +15,31 @@ u32 color;
 
 #define BG (RGBA(255, 255, 255, 255))
 
+#define CURSOR_HOT (8)
+
+u32 cursor[GPU_CURSOR_SIZE * GPU_CURSOR_SIZE];
+
+/* A crosshair with a white outline so it shows up on any colour. */
+static void make_cursor(void) {
+    s64 r;
+    s64 c;
+    s64 dr;
+    s64 dc;
+
+    for (r = 0; r <= 2 * CURSOR_HOT; r += 1) {
+        for (c = 0; c <= 2 * CURSOR_HOT; c += 1) {
+            dr = r - CURSOR_HOT;
+            dc = c - CURSOR_HOT;
+
+            if (dr == 0 || dc == 0) {
+                cursor[r * GPU_CURSOR_SIZE + c] = RGBA(0, 0, 0, 255);
+            } else if (dr == 1 || dr == -1 || dc == 1 || dc == -1) {
+                cursor[r * GPU_CURSOR_SIZE + c] = RGBA(255, 255, 255, 255);
+            }
+        }
+    }
+}
+
 void main(void) {
     s64       ctx;
     Win_Event event;
@@ -33,6 +58,10 @@ void main(void) {
     win_clear(ctx, BG);
     win_commit(ctx);
 
+    /* The cursor is drawn by the device, so following the pointer needs no redraw of the window. */
+    make_cursor();
+    win_set_cursor(cursor, CURSOR_HOT, CURSOR_HOT);
+
     for (;;) {
         win_poll_events(ctx);
 
@@ -86,6 +115,7 @@ void main(void) {
                 case WIN_EVT_CURSOR:
                     x = event.x;
                     y = event.y;
+                    win_move_cursor(ctx, x, y);
                     break;
             }
 
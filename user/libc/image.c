@@ -0,0 +1,313 @@
+#include "image.h"
+#include "syscall.h"
+#include "window.h"
+
+#define QOI_OP_INDEX (0x00)
+#define QOI_OP_DIFF  (0x40)
+#define QOI_OP_LUMA  (0x80)
+#define QOI_OP_RUN   (0xc0)
+#define QOI_OP_RGB   (0xfe)
+#define QOI_OP_RGBA  (0xff)
+#define QOI_MASK     (0xc0)
+
+#define QOI_HASH(_r, _g, _b, _a) (((_r) * 3 + (_g) * 5 + (_b) * 7 + (_a) * 11) % 64)
+
+/* Refills the buffer when it runs dry. Returns the number of bytes ready, 0 at the end of the file. */
+static u32 fill(Image *img) {
+    s64 n;
+
+    if (img->pos == img->len) {
+        n = syscall(SYS_READ, img->fd, img->buff, IMG_BUFF_SIZE);
+
+        img->pos = 0;
+        img->len = n > 0 ? n : 0;
+    }
+
+    return img->len - img->pos;
+}
+
+static s32 next_byte(Image *img) {
+    s32 c;
+
+    if (fill(img) == 0) { return -1; }
+
+    c         = img->buff[img->pos];
+    img->pos += 1;
+
+    return c;
+}
+
+/* Returns -1 if the file ends before n bytes have been read. */
+static s64 next_bytes(Image *img, u8 *out, u32 n) {
+    u32 i;
+    s32 c;
+
+    for (i = 0; i < n; i += 1) {
+        if ((c = next_byte(img)) == -1) { return -1; }
+        out[i] = c;
+    }
+
+    return 0;
+}
+
+static s32 is_space(s32 c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * PGM/PPM header fields are decimal numbers separated by whitespace, with
+ * '#' comments running to the end of a line. The single whitespace byte
+ * that ends the last field is consumed along with it, which leaves the
+ * reader at the first byte of the raster.
+ */
+static s64 pnm_field(Image *img, u32 *out) {
+    s32 c;
+    u32 n;
+
+    do {
+        c = next_byte(img);
+
+        if (c == '#') {
+            while (c != '\n' && c != -1) { c = next_byte(img); }
+        }
+    } while (is_space(c));
+
+    if (c < '0' || c > '9') { return -1; }
+
+    n = 0;
+
+    while (c >= '0' && c <= '9') {
+        n = n * 10 + (c - '0');
+        c = next_byte(img);
+    }
+
+    if (!is_space(c)) { return -1; }
+
+    *out = n;
+
+    return 0;
+}
+
+static u32 be32(const u8 *p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+static s64 qoi_header(Image *img) {
+    u8 header[12];
+
+    /* "qo" has already been read. */
+    if (next_bytes(img, header, sizeof(header)) != 0) { return -1; }
+
+    if (header[0] != 'i' || header[1] != 'f') { return -1; }
+
+    img->w = be32(header + 2);
+    img->h = be32(header + 6);
+
+    /* header[10] is the channel count and header[11] the colour space; neither changes decoding. */
+    return 0;
+}
+
+s64 img_open(Image *img, const char *path) {
+    s32 magic[2];
+
+    img->pos = 0;
+    img->len = 0;
+
+    if ((img->fd = syscall(SYS_OPEN, path)) == -1) { return -1; }
+
+    magic[0] = next_byte(img);
+    magic[1] = next_byte(img);
+
+    if (magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+        img->format = magic[1] == '5' ? IMG_PGM : IMG_PPM;
+
+        if (pnm_field(img, &img->w)      != 0
+        ||  pnm_field(img, &img->h)      != 0
+        ||  pnm_field(img, &img->maxval) != 0
+        ||  img->maxval == 0
+        ||  img->maxval > 255) {
+
+            goto fail;
+        }
+    } else if (magic[0] == 'q' && magic[1] == 'o') {
+        img->format = IMG_QOI;
+
+        if (qoi_header(img) != 0) { goto fail; }
+    } else {
+        goto fail;
+    }
+
+    if (img->w == 0 || img->h == 0) { goto fail; }
+
+    return 0;
+
+fail:;
+    img_close(img);
+    return -1;
+}
+
+/*
+ * Converts straight out of the read buffer, as many pixels at a time as it
+ * holds. Only a pixel split across two reads goes byte by byte.
+ */
+static s64 decode_pnm(Image *img, u32 *dst, u32 stride, u32 max_w, u32 max_h) {
+    u8   scale[256];
+    u32  channels;
+    u32  x;
+    u32  y;
+    u32  n;
+    u32  i;
+    u32  w;
+    u32 *row;
+    u8  *p;
+    s32  c[3];
+
+    /* Samples over maxval are clamped. */
+    for (i = 0; i < 256; i += 1) {
+        scale[i] = i >= img->maxval ? 255 : i * 255 / img->maxval;
+    }
+
+    channels = img->format == IMG_PPM ? 3 : 1;
+    w        = MIN(img->w, max_w);
+
+    for (y = 0; y < img->h && y < max_h; y += 1) {
+        row = dst + y * stride;
+
+        for (x = 0; x < img->w;) {
+            if (fill(img) < channels) {
+                for (i = 0; i < channels; i += 1) {
+                    if ((c[i] = next_byte(img)) == -1) { return -1; }
+                }
+
+                if (x < w) {
+                    row[x] = channels == 3
+                           ? RGBA(scale[c[0]], scale[c[1]], scale[c[2]], 255)
+                           : RGBA(scale[c[0]], scale[c[0]], scale[c[0]], 255);
+                }
+
+                x += 1;
+                continue;
+            }
+
+            p = img->buff + img->pos;
+            n = MIN(img->w - x, (img->len - img->pos) / channels);
+
+            img->pos += n * channels;
+
+            for (i = 0; i < n; i += 1, x += 1, p += channels) {
+                if (x >= w) { continue; }
+
+                if (channels == 3) {
+                    row[x] = RGBA(scale[p[0]], scale[p[1]], scale[p[2]], 255);
+                } else {
+                    row[x] = RGBA(scale[p[0]], scale[p[0]], scale[p[0]], 255);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static s64 decode_qoi(Image *img, u32 *dst, u32 stride, u32 max_w, u32 max_h) {
+    u32 index[64];
+    u32 x;
+    u32 y;
+    u32 i;
+    u32 run;
+    s32 b1;
+    s32 b2;
+    u8  px[4];
+    u8  r;
+    u8  g;
+    u8  b;
+    u8  a;
+    u8  vg;
+
+    for (i = 0; i < 64; i += 1) {
+        index[i] = 0;
+    }
+
+    r   = g = b = 0;
+    a   = 255;
+    run = 0;
+
+    /* Rows past max_h don't need decoding; nothing after them depends on them. */
+    for (y = 0; y < img->h && y < max_h; y += 1) {
+        for (x = 0; x < img->w; x += 1) {
+            if (run > 0) {
+                run -= 1;
+            } else {
+                if ((b1 = next_byte(img)) == -1) { return -1; }
+
+                if (b1 == QOI_OP_RGB) {
+                    if (next_bytes(img, px, 3) != 0) { return -1; }
+                    r = px[0];
+                    g = px[1];
+                    b = px[2];
+                } else if (b1 == QOI_OP_RGBA) {
+                    if (next_bytes(img, px, 4) != 0) { return -1; }
+                    r = px[0];
+                    g = px[1];
+                    b = px[2];
+                    a = px[3];
+                } else {
+                    switch (b1 & QOI_MASK) {
+                        case QOI_OP_INDEX:
+                            r = index[b1] & 0xff;
+                            g = (index[b1] >> 8)  & 0xff;
+                            b = (index[b1] >> 16) & 0xff;
+                            a = (index[b1] >> 24) & 0xff;
+                            break;
+                        case QOI_OP_DIFF:
+                            r += ((b1 >> 4) & 0x03) - 2;
+                            g += ((b1 >> 2) & 0x03) - 2;
+                            b += ( b1       & 0x03) - 2;
+                            break;
+                        case QOI_OP_LUMA:
+                            if ((b2 = next_byte(img)) == -1) { return -1; }
+                            vg  = (b1 & 0x3f) - 32;
+                            r  += vg - 8 + ((b2 >> 4) & 0x0f);
+                            g  += vg;
+                            b  += vg - 8 + (b2 & 0x0f);
+                            break;
+                        case QOI_OP_RUN:
+                            run = b1 & 0x3f;
+                            break;
+                    }
+                }
+
+                index[QOI_HASH(r, g, b, a)] = RGBA(r, g, b, a);
+            }
+
+            if (x < max_w) {
+                dst[y * stride + x] = RGBA(r, g, b, a);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decodes into dst, which has stride pixels per row. Anything beyond max_w x
+ * max_h is dropped. Returns -1 if the file ends early.
+ */
+s64 img_decode(Image *img, u32 *dst, u32 stride, u32 max_w, u32 max_h) {
+    switch (img->format) {
+        case IMG_PGM:
+        case IMG_PPM:
+            return decode_pnm(img, dst, stride, max_w, max_h);
+        case IMG_QOI:
+            return decode_qoi(img, dst, stride, max_w, max_h);
+    }
+
+    return -1;
+}
+
+void img_close(Image *img) {
+    if (img->fd != -1) {
+        syscall(SYS_CLOSE, img->fd);
+        img->fd = -1;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "common.h"
+
+/*
+ * Image decoding straight from a file into 32-bit RGBA pixels (the same
+ * layout as RGBA() in window.h). Binary PGM (P5), binary PPM (P6) and QOI
+ * are understood. The file is read through a small buffer as it is decoded,
+ * so the whole file is never in memory and pixels can go directly into a
+ * mapped window surface.
+ */
+
+#define IMG_BUFF_SIZE (4096)
+
+enum {
+    IMG_PGM,
+    IMG_PPM,
+    IMG_QOI,
+};
+
+typedef struct {
+    s64 fd;
+    u32 format;
+    u32 w;
+    u32 h;
+    u32 maxval; /* PGM/PPM only. */
+    u32 pos;
+    u32 len;
+    u8  buff[IMG_BUFF_SIZE];
+} Image;
+
+s64  img_open(Image *img, const char *path);
+s64  img_decode(Image *img, u32 *dst, u32 stride, u32 max_w, u32 max_h);
+void img_close(Image *img);
+
+#endif
@@ -9,7 +9,8 @@ typedef struct {
     u32 h;
 } Win;
 
-static Win wins[2];
+static Win wins[GPU_MAX_WINDOWS];
+static Win screen;
 
 static void update_win(s64 ctx) {
     syscall(SYS_GPU_CTX_GET_RECT,
@@ -18,6 +19,14 @@ static void update_win(s64 ctx) {
             &wins[ctx].y,
             &wins[ctx].w,
             &wins[ctx].h);
+
+    /* ctx -1 is the whole screen, which input coordinates are relative to. */
+    syscall(SYS_GPU_CTX_GET_RECT,
+            -1,
+            &screen.x,
+            &screen.y,
+            &screen.w,
+            &screen.h);
 }
 
 s64 win_ctx(void) {
@@ -58,6 +67,32 @@ void win_commit(s64 ctx) {
     syscall(SYS_GPU_COMMIT, ctx);
 }
 
+/*
+ * Maps the window's pixels (w x h, row-major) into the process. Drawing
+ * into them directly and calling win_commit() replaces win_pixels().
+ */
+u32 *win_map(s64 ctx, u32 *w, u32 *h) {
+    s64 addr;
+
+    addr = syscall(SYS_GPU_MAP_CTX, ctx, w, h);
+
+    return addr == -1 ? NULL : (u32*)addr;
+}
+
+/* pixels is GPU_CURSOR_SIZE x GPU_CURSOR_SIZE. */
+void win_set_cursor(u32 *pixels, u32 hot_x, u32 hot_y) {
+    syscall(SYS_GPU_SET_CURSOR, pixels, hot_x, hot_y);
+}
+
+void win_move_cursor(s64 ctx, u32 x, u32 y) {
+    syscall(SYS_GPU_MOVE_CURSOR, ctx, x, y);
+}
+
+/* Blocks until the next frame starts. stats may be NULL. */
+u64 win_wait_frame(GPU_Frame_Stats *stats) {
+    return syscall(SYS_GPU_WAIT_FRAME, stats);
+}
+
 void win_poll_events(s64 ctx) {
     (void)ctx;
     syscall(SYS_INPUT_POLL);
@@ -69,6 +104,7 @@ static u32 save_y;
 u32 win_event(s64 ctx, Win_Event *event) {
     s64         status;
     Input_Event e;
+    s64         pos;
 
     (void)ctx;
 
@@ -87,10 +123,13 @@ u32 win_event(s64 ctx, Win_Event *event) {
                 event->action = e.value;
                 break;
             case EV_ABS:
+                /* Pointer positions left of or above the window clamp to its edge. */
                 if (e.code == ABS_X) {
-                    save_x = (((u64)e.value) * (2 * (u64)wins[ctx].w)) / 32767ULL;
+                    pos    = (s64)((((u64)e.value) * (u64)screen.w) / 32767ULL) - (s64)wins[ctx].x;
+                    save_x = pos < 0 ? 0 : pos;
                 } else if (e.code == ABS_Y) {
-                    save_y = (((u64)e.value) * (u64)wins[ctx].h) / 32767ULL;
+                    pos    = (s64)((((u64)e.value) * (u64)screen.h) / 32767ULL) - (s64)wins[ctx].y;
+                    save_y = pos < 0 ? 0 : pos;
                 }
                 event->kind = WIN_EVT_CURSOR;
                 event->x    = save_x;
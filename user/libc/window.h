@@ -2,6 +2,7 @@
 #define __WINDOW_H__
 
 #include "common.h"
+#include "syscall.h"
 #include "../../src/include/input_event_codes.h"
 
 #define RGBA(_r, _g, _b, _a) ((_r) | ((_g) << 8ULL) | ((_b) << 16ULL) | ((_a) << 24ULL))
@@ -33,6 +34,10 @@ void win_get_rect(s64 ctx, u32 *x, u32 *y, u32 *w, u32 *h);
 void win_pixels(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 *pixels);
 void win_rect(s64 ctx, u32 x, u32 y, u32 w, u32 h, u32 rgba_color);
 void win_commit(s64 ctx);
+u32 *win_map(s64 ctx, u32 *w, u32 *h);
+void win_set_cursor(u32 *pixels, u32 hot_x, u32 hot_y);
+void win_move_cursor(s64 ctx, u32 x, u32 y);
+u64  win_wait_frame(GPU_Frame_Stats *stats);
 void win_poll_events(s64 ctx);
 u32  win_event(s64 ctx, Win_Event *event);
 
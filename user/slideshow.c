@@ -1,42 +1,23 @@
 #include "syscall.h"
 #include "printf.h"
 #include "window.h"
+#include "image.h"
 
-static inline s32 is_digit(s32 c) {
-    return (u32)(('0' - 1 - c) & (c - ('9' + 1))) >> (sizeof(c) * 8 - 1);
-}
-
-static s32 stoi(const char *s) {
-    u32 is_neg;
-    s32 r;
-
-    is_neg = *s == '-';
-    if (is_neg) { s += 1; }
-
-    r = 0;
-    while (*s && is_digit(*s)) {
-        r *= 10;
-        r += *s - '0';
-        s += 1;
-    }
+#define BG (RGBA(0, 255, 0, 255))
 
-    if (is_neg) { r = -r; }
-
-    return r;
-}
+static Image img;
 
 void main(void) {
     s64   ctx;
-    u8   *buff;
-    u32  *image;
-    s64   len;
-    char *p;
     u64   i;
     u64   j;
-    u32   x;
-    u32   y;
+    u64   k;
     u32   w;
     u32   h;
+    u32  *fb;
+    u32  *row;
+    u32   fw;
+    u32   fh;
 
     ctx = win_ctx();
 
@@ -45,36 +26,49 @@ void main(void) {
         return;
     }
 
-    buff  = (void*)syscall(SYS_MAP_MEM, 8192);
-    image = (void*)syscall(SYS_MAP_MEM, KB(64));
+    if ((fb = win_map(ctx, &fw, &fh)) == NULL) {
+        printf("[slideshow]: %rFailed to map window!%_\n");
+        goto out_release;
+    }
 
-    len = syscall(SYS_FILE_SIZE, "/EYE.PGM");
-    syscall(SYS_FILE_READ, "/EYE.PGM", buff, 0, len);
+    if (img_open(&img, "/EYE.PGM") != 0) {
+        printf("[slideshow]: %rFailed to open /EYE.PGM!%_\n");
+        goto out_release;
+    }
 
-    p = (char*)buff;
-    while (*p) { if (*p == '\n') { p += 1; break; } p += 1; }
-    while (*p) { if (*p == '\n') { p += 1; break; } p += 1; }
-    w = stoi(p);
-    while (*p) { if (*p == ' ')  { p += 1; break; } p += 1; }
-    h = stoi(p);
-    while (*p) { if (*p == '\n') { p += 1; break; } p += 1; }
-    while (*p) { if (*p == '\n') { p += 1; break; } p += 1; }
+    w = img.w;
+    h = img.h;
 
     printf("image is %u x %u\n", w, h);
 
-    for (i = 0; i < w; i += 1) {
-        for (j = 0; j < h; j += 1) {
-            image[i * w + j] = RGBA(*p, *p, *p, 255);
-            p += 1;
-        }
+    win_clear(ctx, BG);
+
+    /* Straight into the window; there is no copy of the image anywhere else. */
+    if (img_decode(&img, fb, fw, fw, fh) != 0) {
+        printf("[slideshow]: %rFailed to decode /EYE.PGM!%_\n");
     }
 
+    img_close(&img);
+
+    w = MIN(w, fw);
+    h = MIN(h, fh);
+
+    /* Slide the image right a pixel per frame, filling in behind it. */
     for (i = 0; 1; i += 1) {
-        win_get_rect(ctx, &x, &y, &w, &h);
-        win_clear(ctx, RGBA(0, 255, 0, 255));
-        win_pixels(ctx, i, 0, w, h, image);
         win_commit(ctx);
-        syscall(SYS_SLEEP, 1000);
+        win_wait_frame(NULL);
+
+        if (i >= fw) { continue; }
+
+        for (j = 0; j < h; j += 1) {
+            row = fb + j * fw;
+
+            for (k = MIN(i + w, fw - 1); k > i; k -= 1) {
+                row[k] = row[k - 1];
+            }
+
+            row[i] = BG;
+        }
     }
 
 out_release:;